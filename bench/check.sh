@@ -0,0 +1,187 @@
+#!/bin/sh
+# Teste diferencial: a saída do JIT comparada byte a byte com a do
+# interpretador de referência (pqp_ref.cpp).
+#
+#   bench/check.sh [-n programas] [-s semente]
+#
+# Compila da árvore atual o simple_jit_pqp, o pqp_drive (a libpqp em fatias e
+# com snapshots), o pqp_ref e o pqp_fuzz, e roda:
+#   - os casos de bench/cases (os vector_*.txt com --mem-bits 16), com cada
+#     conjunto de opções de variant() na linha de comando, em fatias e
+#     passando por snapshots;
+#   - os mesmos casos como imagem binária com a entrada em pc 8, e imagens com
+#     entrada inválida ou campos reservados diferentes de zero, que têm de ser
+#     recusadas;
+#   - os casos de pqp_drive regress, que conferem o próprio resultado, e um
+#     cache de código truncado, que tem de ser ignorado;
+#   - n programas de cada tipo do pqp_fuzz (code e vector) a partir da
+#     semente, cada um com um conjunto de opções em rodízio. Os que a
+#     referência não termina em 10^6 instruções são pulados.
+#
+# Termina com 1 se alguma saída diferir. Os programas que falharam são
+# copiados para ${TMPDIR:-/tmp}/pqp_check_failed.
+
+count=100
+seed=1
+while getopts n:s: option; do
+    case $option in
+    n) count=$OPTARG ;;
+    s) seed=$OPTARG ;;
+    *) exit 1 ;;
+    esac
+done
+
+root=$(dirname "$0")/..
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed_dir=${TMPDIR:-/tmp}/pqp_check_failed
+
+g++ -std=c++11 -O2 -c -o "$work/pqp.o" "$root/pqp.cpp" &&
+    g++ -std=c++11 -O2 -pthread -o "$work/simple_jit_pqp" "$root/simple_jit_pqp.cpp" "$work/pqp.o" &&
+    g++ -std=c++11 -O2 -pthread -o "$work/pqp_drive" "$root/bench/pqp_drive.cpp" "$work/pqp.o" &&
+    g++ -std=c++11 -O2 -o "$work/pqp_ref" "$root/bench/pqp_ref.cpp" &&
+    g++ -std=c++11 -O2 -o "$work/pqp_fuzz" "$root/bench/pqp_fuzz.cpp" || exit 1
+
+# Conjuntos de opções; o log binário é convertido para texto antes da comparação
+variants=6
+variant() {
+    case $1 in
+    0) echo "" ;;
+    1) echo "--counters off" ;;
+    2) echo "--code-pages rwx" ;;
+    3) echo "--mem-bits 16" ;;
+    4) echo "--trace off" ;;
+    5) echo "--trace binary" ;;
+    esac
+}
+
+passed=0
+failed=0
+skipped=0
+
+# check jit|slice|snapshot "opções" programa nome
+check() {
+    mode=$1
+    options=$2
+    program=$3
+    name=$4
+
+    case $mode in
+    snapshot) expected_options="$options --trace off" ;;
+    *) expected_options=$(echo "$options" | sed 's/--trace binary/--trace text/') ;;
+    esac
+    "$work/pqp_ref" --max-steps 1000000 $expected_options "$program" "$work/expected.txt"
+    case $? in
+    0) ;;
+    2)
+        skipped=$((skipped + 1))
+        return
+        ;;
+    *) exit 1 ;;
+    esac
+
+    rm -f "$work/output.txt" "$work/trace.bin"
+    case $mode in
+    jit)
+        if echo "$options" | grep -q -- "--trace binary"; then
+            timeout 60 "$work/simple_jit_pqp" $options "$program" "$work/trace.bin" &&
+                "$work/simple_jit_pqp" --decode-trace "$work/trace.bin" "$work/output.txt"
+        else
+            timeout 60 "$work/simple_jit_pqp" $options "$program" "$work/output.txt"
+        fi
+        ;;
+    *) timeout 60 "$work/pqp_drive" $mode $options "$program" "$work/output.txt" ;;
+    esac
+    status=$?
+
+    if [ $status -eq 0 ] && cmp -s "$work/expected.txt" "$work/output.txt"; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        mkdir -p "$failed_dir"
+        cp "$program" "$failed_dir/$name.txt"
+        echo "FAIL $mode $options $failed_dir/$name.txt (status $status)"
+    fi
+}
+
+for program in "$root"/bench/cases/*.txt; do
+    [ -e "$program" ] || continue
+    name=$(basename "$program" .txt)
+    base=""
+    case $name in
+    vector_*) base="--mem-bits 16" ;;
+    esac
+    i=0
+    while [ $i -lt $variants ]; do
+        check jit "$base $(variant $i)" "$program" "$name"
+        i=$((i + 1))
+    done
+    check slice "$base" "$program" "$name"
+    check snapshot "$base" "$program" "$name"
+done
+
+# Os mesmos casos como imagem binária com a entrada em pc 8. A instrução de
+# entrada é destino de salto, então não herda o cmp de antes dela.
+for program in "$root"/bench/cases/*.txt; do
+    [ -e "$program" ] || continue
+    name=$(basename "$program" .txt)
+    base=""
+    case $name in
+    vector_*) base="--mem-bits 16" ;;
+    esac
+    "$work/simple_jit_pqp" $base --make-image "$work/image.pqp" "$program" || exit 1
+    printf '\010' | dd of="$work/image.pqp" bs=1 seek=8 conv=notrunc 2>/dev/null
+    check jit "$base" "$work/image.pqp" "${name}_entry_8"
+    check slice "$base" "$work/image.pqp" "${name}_entry_8"
+done
+
+# Entradas desalinhadas ou fora da imagem e campos reservados diferentes de
+# zero são recusados (offset no cabeçalho e byte escrito nele)
+for patch in '8 \006' '8 \374' '24 \001' '28 \001'; do
+    "$work/simple_jit_pqp" --make-image "$work/image.pqp" "$root/bench/cases/entry_01.txt" || exit 1
+    printf "${patch#* }" | dd of="$work/image.pqp" bs=1 seek="${patch% *}" conv=notrunc 2>/dev/null
+    if "$work/simple_jit_pqp" "$work/image.pqp" "$work/output.txt" 2>/dev/null; then
+        failed=$((failed + 1))
+        echo "FAIL image patched at $patch loaded"
+    else
+        passed=$((passed + 1))
+    fi
+done
+
+# Casos da API que a referência não reproduz
+if "$work/pqp_drive" regress "$work"; then
+    passed=$((passed + 1))
+else
+    failed=$((failed + 1))
+    echo "FAIL pqp_drive regress"
+fi
+
+# Um cache de código truncado (gravação interrompida) é ignorado e regravado
+mkdir "$work/cache"
+"$work/simple_jit_pqp" --trace off --code-cache "$work/cache" "$root/input.txt" "$work/expected.txt" || exit 1
+for cache in "$work"/cache/*.pqpc; do
+    truncate -s 4096 "$cache"
+done
+if "$work/simple_jit_pqp" --trace off --code-cache "$work/cache" "$root/input.txt" "$work/output.txt" &&
+    cmp -s "$work/expected.txt" "$work/output.txt"; then
+    passed=$((passed + 1))
+else
+    failed=$((failed + 1))
+    echo "FAIL truncated code cache"
+fi
+
+i=0
+while [ $i -lt "$count" ]; do
+    n=$((seed + i))
+    "$work/pqp_fuzz" code $n > "$work/code.txt"
+    check jit "$(variant $((i % variants)))" "$work/code.txt" "code_$n"
+    check slice "$(variant $(((i + 1) % variants)))" "$work/code.txt" "code_$n"
+    check snapshot "$(variant $(((i + 2) % variants)))" "$work/code.txt" "code_$n"
+    "$work/pqp_fuzz" vector $n 16 > "$work/vector.txt"
+    check jit "--mem-bits 16 $(variant $((i % variants)))" "$work/vector.txt" "vector_$n"
+    check slice "--mem-bits 16" "$work/vector.txt" "vector_$n"
+    i=$((i + 1))
+done
+
+echo "passed $passed failed $failed skipped $skipped"
+[ $failed -eq 0 ]
@@ -0,0 +1,239 @@
+#include "../pqp.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+#include <string>
+
+using std::string;
+
+// Executa um programa pela libpqp de formas que a linha de comando não usa,
+// para o teste diferencial (bench/check.sh) comparar a saída com a do
+// interpretador de referência:
+//
+//   pqp_drive slice [opções] input output
+//   pqp_drive snapshot [opções] input output
+//   pqp_drive regress diretório
+//
+// slice: pqp_run() em fatias de 1 a 13 passos, retomando de pqp_pc().
+// snapshot: as mesmas fatias, mas a cada fatia o estado passa para outra de
+// três VMs com pqp_snapshot()/pqp_restore() (às vezes para a própria). O log
+// não faz parte do snapshot, então esse modo roda sem log (--trace off).
+//
+// regress: casos da API que a referência não reproduz. Cada um grava um
+// programa no diretório, roda e confere os registradores no fim.
+//
+// As opções são as da linha de comando: --mem-bits, --trace off|text,
+// --counters e --code-pages.
+
+#define SNAPSHOT_VMS 3
+
+static bool run_sliced(Machine_x86 *vm)
+{
+    uint64_t steps = 1;
+
+    while (pqp_run(vm, steps) == RUN_STEP_LIMIT)
+    {
+        steps = steps % 13 + 1;
+    }
+    return true;
+}
+
+static bool run_snapshots(const Vm_options &options, const char *input_path, const char *output_path)
+{
+    Machine_x86 *vms[SNAPSHOT_VMS];
+    uint64_t steps = 1;
+    uint32_t current = 0;
+    bool done = true;
+
+    for (int i = 0; i < SNAPSHOT_VMS; i++)
+    {
+        vms[i] = pqp_create(options);
+    }
+    // Uma VM de destino já usada por outro programa, com código compilado
+    pqp_load(vms[SNAPSHOT_VMS - 1], input_path);
+    pqp_run(vms[SNAPSHOT_VMS - 1], 5);
+
+    if (!pqp_load(vms[0], input_path))
+    {
+        done = false;
+    }
+    while (done && pqp_run(vms[current % SNAPSHOT_VMS], steps) == RUN_STEP_LIMIT)
+    {
+        steps = steps % 13 + 1;
+        Vm_snapshot *snapshot = pqp_snapshot(vms[current % SNAPSHOT_VMS]);
+        if (current % 4 != 3)
+        {
+            current++;
+        }
+        done = snapshot != nullptr && pqp_restore(vms[current % SNAPSHOT_VMS], snapshot);
+        pqp_snapshot_destroy(snapshot);
+    }
+    done = done && pqp_open_output(vms[current % SNAPSHOT_VMS], output_path) &&
+           pqp_finish(vms[current % SNAPSHOT_VMS]);
+
+    for (int i = 0; i < SNAPSHOT_VMS; i++)
+    {
+        pqp_destroy(vms[i]);
+    }
+    return done;
+}
+
+static bool write_program(const string &path, const char *program)
+{
+    FILE *output = fopen(path.c_str(), "w");
+
+    if (output == nullptr)
+    {
+        return false;
+    }
+    fputs(program, output);
+    return fclose(output) == 0;
+}
+
+// Para depois do jcc em stop_pc, zera R1, que o cmp em 4 já comparou com R0, e
+// roda até o fim: o je seguinte tem de ver o cmp de antes (5 com 0, não salta)
+static bool run_set_register(const Vm_options &options, const char *directory, const char *program,
+                             uint32_t stop_pc)
+{
+    string path = string(directory) + "/regress.txt";
+
+    if (!write_program(path, program))
+    {
+        return false;
+    }
+    Machine_x86 *vm = pqp_create(options);
+    bool done = pqp_load(vm, path.c_str());
+    while (done && pqp_pc(vm) != stop_pc && pqp_run(vm, 1) == RUN_STEP_LIMIT)
+    {
+    }
+    done = done && pqp_pc(vm) == stop_pc;
+    pqp_set_register(vm, 1, 0);
+    done = done && pqp_run(vm, 0) == RUN_EXITED && pqp_register(vm, 1) == 0 && pqp_register(vm, 2) == 7;
+    pqp_destroy(vm);
+    if (!done)
+    {
+        fprintf(stderr, "FAIL set_register stopped at 0x%04X\n", stop_pc);
+    }
+    return done;
+}
+
+// Laço de R1 voltas, que pqp_finish() grava no cache de código (se houver)
+static bool run_loop(const Vm_options &options, const string &path, int32_t count, Run_stats &stats)
+{
+    Machine_x86 *vm = pqp_create(options);
+    bool done = pqp_load(vm, path.c_str());
+
+    pqp_set_register(vm, 1, count);
+    done = done && pqp_run(vm, 0) == RUN_EXITED && pqp_register(vm, 2) == count;
+    pqp_stats(vm, stats);
+    done = done && pqp_finish(vm);
+    pqp_destroy(vm);
+    return done;
+}
+
+// Cache gravado por uma execução curta do laço: a execução longa que parte
+// dele tem de chegar à mesma região otimizada que a execução a frio, e a
+// seguinte, partindo do cache regravado, também
+static bool run_warm_start(Vm_options options, const char *directory)
+{
+    // mov r3, 1; add r2, r3; cmp r2, r1; jl -12
+    string path = string(directory) + "/loop.txt";
+    string cache_dir = string(directory) + "/cacheXXXXXX";
+    Run_stats cold;
+    Run_stats warm[2];
+    Run_stats primed;
+
+    if (!write_program(path, "00 30 01 00 09 23 00 00 04 21 00 00 07 00 F4 FF FF 00 00 00") ||
+        mkdtemp(&cache_dir[0]) == nullptr)
+    {
+        return false;
+    }
+    bool done = run_loop(options, path, 2000000, cold);
+    options.cache_dir = cache_dir.c_str();
+    done = run_loop(options, path, 10, primed) && done;
+    for (int i = 0; i < 2; i++)
+    {
+        done = run_loop(options, path, 2000000, warm[i]) && done;
+        if (warm[i].code_bytes != cold.code_bytes || warm[i].guest_instructions != cold.guest_instructions)
+        {
+            fprintf(stderr, "FAIL warm start %d: %u code bytes, %llu instructions (cold: %u, %llu)\n", i + 1,
+                    warm[i].code_bytes, (unsigned long long)warm[i].guest_instructions, cold.code_bytes,
+                    (unsigned long long)cold.guest_instructions);
+            done = false;
+        }
+    }
+    return done;
+}
+
+static bool run_regress(Vm_options options, const char *directory)
+{
+    options.trace_mode = TRACE_OFF;
+    // mov r1, 5; cmp r1, r0; jl +4; je +4; mov r2, 7
+    bool done = run_set_register(options, directory, "00 10 05 00 04 10 00 00 07 00 04 00 08 00 04 00 00 20 07 00 FF 00 00 00", 12);
+    // O mesmo com um add r3, r3 entre o jl e o je
+    done = run_set_register(options, directory,
+                            "00 10 05 00 04 10 00 00 07 00 08 00 09 33 00 00 08 00 04 00 00 20 07 00 FF 00 00 00", 12) &&
+           done;
+    done = run_warm_start(options, directory) && done;
+    return done;
+}
+
+int main(int argc, char **argv)
+{
+    Vm_options options = {DEFAULT_MEMORY_BITS, TRACE_TEXT, true, true, nullptr, false};
+    int arg = 2;
+
+    while (arg + 1 < argc && strncmp(argv[arg], "--", 2) == 0)
+    {
+        if (strcmp(argv[arg], "--mem-bits") == 0)
+        {
+            options.memory_bits = atoi(argv[arg + 1]);
+        }
+        else if (strcmp(argv[arg], "--trace") == 0)
+        {
+            options.trace_mode = strcmp(argv[arg + 1], "off") == 0 ? TRACE_OFF : TRACE_TEXT;
+        }
+        else if (strcmp(argv[arg], "--counters") == 0)
+        {
+            options.count_instructions = strcmp(argv[arg + 1], "off") != 0;
+        }
+        else if (strcmp(argv[arg], "--code-pages") == 0)
+        {
+            options.write_xor_execute = strcmp(argv[arg + 1], "rwx") != 0;
+        }
+        else
+        {
+            break;
+        }
+        arg += 2;
+    }
+    if (argc == 3 && strcmp(argv[1], "regress") == 0)
+    {
+        return run_regress(options, argv[2]) ? 0 : 1;
+    }
+    if (argc < 2 || arg + 2 != argc || (strcmp(argv[1], "slice") != 0 && strcmp(argv[1], "snapshot") != 0))
+    {
+        fprintf(stderr, "usage: %s slice|snapshot [options] input output\n"
+                        "       %s regress directory\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "snapshot") == 0)
+    {
+        options.trace_mode = TRACE_OFF;
+        return run_snapshots(options, argv[arg], argv[arg + 1]) ? 0 : 1;
+    }
+
+    Machine_x86 *vm = pqp_create(options);
+    if (vm == nullptr)
+    {
+        fprintf(stderr, "cannot create VM\n");
+        return 1;
+    }
+    bool done = pqp_load(vm, argv[arg]) && pqp_open_output(vm, argv[arg + 1]) && run_sliced(vm) && pqp_finish(vm);
+    pqp_destroy(vm);
+    return done ? 0 : 1;
+}
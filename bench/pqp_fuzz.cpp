@@ -0,0 +1,410 @@
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+
+using namespace std;
+
+// Gerador de programas PQP aleatórios para o teste diferencial (bench/check.sh).
+// A mesma semente gera sempre o mesmo programa.
+//
+//   pqp_fuzz code|vector semente [mem_bits] > programa.txt
+//
+// code: um laço com operações aleatórias, cmp seguidos de jcc com instruções no
+// meio (que às vezes escrevem os registradores comparados), jcc soltos, loads e
+// stores perto do programa e stores que montam palavras de instrução e as
+// gravam no próprio código. Parte dos laços tem um caminho só e é desenrolada.
+// vector: laços de loads, operações e stores palavra a palavra, no formato que
+// o vetorizador aceita ou quase (passo, sobreposição, volta na máscara), dentro
+// de um laço externo, e no fim um checksum de toda a memória em r0. mem_bits
+// (padrão 16) precisa ser o --mem-bits da execução.
+
+#define INSTRUCTION_SIZE 4
+
+// splitmix64
+struct Random
+{
+    uint64_t state;
+
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // Inteiro em [low, high)
+    int32_t range(int32_t low, int32_t high)
+    {
+        return low + (int32_t)(next() % (uint32_t)(high - low));
+    }
+
+    double real()
+    {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    template <typename T>
+    T choice(const vector<T> &values)
+    {
+        return values[next() % values.size()];
+    }
+};
+
+struct Program
+{
+    vector<uint8_t> bytes;
+
+    uint32_t size()
+    {
+        return bytes.size() / INSTRUCTION_SIZE;
+    }
+
+    void emit(uint8_t opcode, uint8_t rx, uint8_t ry, int32_t imm)
+    {
+        bytes.push_back(opcode);
+        bytes.push_back((rx << 4) | ry);
+        bytes.push_back(imm & 0xFF);
+        bytes.push_back((imm >> 8) & 0xFF);
+    }
+
+    // Salto para o índice de instrução index
+    void jump(uint8_t opcode, uint32_t index)
+    {
+        emit(opcode, 0, 0, (int32_t)(index - (size() + 1)) * INSTRUCTION_SIZE);
+    }
+};
+
+// Palavra de instrução aleatória montada em a com b e c de rascunho e gravada
+// no endereço de uma instrução do programa (às vezes desalinhado)
+static void emit_code_store(Random &random, Program &program, uint32_t instructions)
+{
+    static const vector<uint8_t> opcodes = {0, 1, 9, 10, 11, 12, 13, 14, 15, 2, 3, 4, 5, 6, 7, 8, 0x30};
+    uint8_t opcode = random.choice(opcodes);
+    int32_t imm = opcode >= 5 && opcode <= 8 ? random.range(-12, 12) * INSTRUCTION_SIZE : random.range(0, 0x10000);
+    uint8_t operands = random.range(0, 256);
+    uint8_t a = random.range(1, 13);
+    uint8_t b = a % 12 + 1;
+    uint8_t c = b % 12 + 1;
+    uint32_t address = random.range(0, instructions + 4) * INSTRUCTION_SIZE + (random.real() < 0.2 ? random.range(0, 4) : 0);
+
+    program.emit(0x00, a, 0, opcode | (operands << 8));
+    program.emit(0x00, b, 0, imm & 0xFFFF);
+    program.emit(0x0E, b, 0, 16 << 8);
+    program.emit(0x00, c, 0, 0xFFFF);
+    program.emit(0x0B, a, c, 0);
+    program.emit(0x0C, a, b, 0);
+    program.emit(0x00, c, 0, address);
+    program.emit(0x03, c, a, 0);
+}
+
+static Program generate_code(Random &random)
+{
+    static const vector<uint8_t> jumps = {6, 7, 8};
+    static const vector<uint8_t> gap_opcodes = {0, 1, 2, 9, 10, 13, 14};
+    static const vector<uint8_t> plain_opcodes = {0, 1, 2, 3, 9, 10, 11, 12, 13, 14, 15, 0, 0, 9};
+    Program program;
+    bool simple = random.real() < 0.4;
+    uint32_t instructions = simple ? random.range(3, 16) : random.range(6, 40);
+    const uint8_t counter = 14;
+
+    program.emit(0x00, counter, 0, simple ? random.range(900, 6000) : random.range(1, 2000));
+    uint32_t body = program.size();
+    while (program.size() < instructions)
+    {
+        double kind = random.real();
+        // Os laços simples quase sempre ficam com um caminho só
+        if (simple && (kind >= 0.2 && kind < 0.3))
+        {
+            kind = 0.5;
+        }
+        if (simple && kind < 0.16 && random.real() < 0.7)
+        {
+            kind = 0.5;
+        }
+
+        if (kind >= 0.13 && kind < 0.16)
+        {
+            program.jump(random.choice(jumps), program.size() + random.range(-(int32_t)program.size(), 5));
+        }
+        else if (kind < 0.12)
+        {
+            emit_code_store(random, program, instructions);
+        }
+        else if (kind < 0.2)
+        {
+            uint8_t a = random.range(1, 14);
+            program.emit(0x00, a, 0, random.range(0, 256));
+            program.emit(random.real() < 0.5 ? 0x02 : 0x03, random.real() < 0.5 ? a : random.range(0, 16),
+                         random.real() < 0.5 ? a : random.range(0, 16), 0);
+        }
+        else if (kind < 0.3)
+        {
+            // cmp, até 4 instruções no meio e o jcc
+            uint8_t a = random.range(0, 16);
+            uint8_t b = random.range(0, 16);
+            int32_t target = program.size() + random.range(-(int32_t)program.size(), 6);
+            program.emit(0x04, a, b, 0);
+            for (int gap = random.range(0, 5); gap > 0; gap--)
+            {
+                double what = random.real();
+                if (what < 0.3)
+                {
+                    program.jump(random.choice(jumps), program.size() + random.range(-(int32_t)program.size(), 4));
+                }
+                else if (what < 0.45)
+                {
+                    program.emit(random.choice(vector<uint8_t>{0, 9, 1}), random.real() < 0.5 ? a : b,
+                                 random.range(0, 16), random.range(-5, 5));
+                }
+                else if (what < 0.55)
+                {
+                    program.emit(0x03, random.range(0, 16), random.range(0, 16), 0);
+                }
+                else
+                {
+                    program.emit(random.choice(gap_opcodes), random.range(0, 14), random.range(0, 16), random.range(0, 32));
+                }
+            }
+            program.jump(random.choice(jumps), target);
+        }
+        else
+        {
+            uint8_t opcode = random.choice(plain_opcodes);
+            int32_t imm = opcode == 0x0E || opcode == 0x0F ? random.range(0, 32) : random.range(-300, 300);
+            program.emit(opcode, random.range(0, 14), random.range(0, 16), imm);
+        }
+    }
+
+    // counter -= 1; cmp counter, 0; jg body
+    program.emit(0x00, 13, 0, 1);
+    program.emit(0x0A, counter, 13, 0);
+    program.emit(0x00, 12, 0, 0);
+    program.emit(0x04, counter, 12, 0);
+    program.jump(0x06, body);
+    // Lixo depois do programa, que os jcc e os stores podem alcançar
+    if (random.real() < 0.5)
+    {
+        for (int i = random.range(0, 12); i > 0; i--)
+        {
+            program.bytes.push_back(random.range(0, 256));
+        }
+    }
+    return program;
+}
+
+static Program generate_vector(Random &random, uint32_t memory_size)
+{
+    // r13 = 0, r14 = 1, r15 = voltas do laço externo; os outros são sorteados
+    vector<uint8_t> free_registers;
+    for (uint8_t r = 0; r < 13; r++)
+    {
+        free_registers.push_back(r);
+    }
+    for (size_t i = free_registers.size() - 1; i > 0; i--)
+    {
+        swap(free_registers[i], free_registers[random.next() % (i + 1)]);
+    }
+    size_t next = 0;
+    vector<uint8_t> pointers(free_registers.begin(), free_registers.begin() + random.range(1, 4));
+    next += pointers.size();
+    uint8_t stride = free_registers[next++];
+    uint8_t counter = free_registers[next++];
+    uint8_t step = free_registers[next++];
+    uint8_t bound = free_registers[next++];
+    vector<uint8_t> temporaries(free_registers.begin() + next, free_registers.begin() + next + random.range(1, 4));
+    next += temporaries.size();
+    vector<uint8_t> invariants(free_registers.begin() + next, free_registers.begin() + next + 2);
+    // Os casos "limpos" são vetorizáveis; os outros quebram uma das condições
+    bool clean = random.real() < 0.5;
+    Program program;
+
+    program.emit(0x00, 13, 0, 0);
+    program.emit(0x00, 14, 0, 1);
+    program.emit(0x00, 15, 0, random.range(3, 40));
+    program.emit(0x00, stride, 0, clean ? 4 : random.choice(vector<int32_t>{4, 4, 4, 4, -4, 8, 1, 0}));
+    int32_t stride_value = (int16_t)(program.bytes[program.bytes.size() - 2] | (program.bytes.back() << 8));
+    for (uint8_t r : invariants)
+    {
+        program.emit(0x00, r, 0, random.range(-32768, 32768));
+    }
+    for (uint8_t r : temporaries)
+    {
+        program.emit(0x00, r, 0, random.range(-100, 100));
+    }
+
+    uint32_t outer = program.size();
+    // Endereço inicial: nos dados, sobre o código, perto do fim ou dando a volta na máscara
+    int placement = random.range(0, 6);
+    uint32_t first = memory_size <= 0x1000 ? random.range(0, memory_size)
+                     : placement < 3      ? 0x200
+                     : placement == 3     ? 0x10
+                     : placement == 4     ? memory_size - 0x400
+                                          : memory_size - 0x40;
+    for (size_t i = 0; i < pointers.size(); i++)
+    {
+        int32_t offset = clean ? random.choice(vector<int32_t>{0x100, -0x100, 0x200, 0})
+                               : random.choice(vector<int32_t>{0, 4, -4, 8, -8, 16, -16, 32, -32, 2, 0x100, -0x100,
+                                                               random.range(-64, 64)});
+        uint32_t address = first + offset * (int32_t)i + (random.real() < 0.3 ? random.range(-40, 40) : 0);
+        program.emit(0x00, pointers[i], 0, address & 0x7FFF);
+    }
+
+    int32_t trips = random.range(0, 301);
+    int mode = random.range(0, 4);
+    bool down = mode == 0 || mode == 3;
+    int32_t step_value = random.choice(vector<int32_t>{1, 1, 1, 2, 3, -1, 7});
+    if (clean && trips < 60)
+    {
+        trips = 60;
+    }
+    program.emit(0x00, step, 0, step_value);
+    if (down)
+    {
+        program.emit(0x00, counter, 0, trips);
+        program.emit(0x00, bound, 0, random.choice(vector<int32_t>{0, 0, 5, -3}));
+    }
+    else
+    {
+        program.emit(0x00, counter, 0, random.choice(vector<int32_t>{0, 0, -5, 3}));
+        program.emit(0x00, bound, 0, trips);
+    }
+
+    uint32_t inner = program.size();
+    Program body;
+    vector<uint8_t> defined;
+    for (int i = random.range(2, 9); i > 0; i--)
+    {
+        double kind = random.real();
+        uint8_t t = random.choice(temporaries);
+        vector<uint8_t> sources = defined;
+        sources.insert(sources.end(), invariants.begin(), invariants.end());
+        bool is_defined = find(defined.begin(), defined.end(), t) != defined.end();
+
+        if (kind < 0.25 || defined.empty())
+        {
+            body.emit(0x02, t, random.choice(pointers), 0);
+            if (!is_defined)
+            {
+                defined.push_back(t);
+            }
+        }
+        else if (kind < 0.45)
+        {
+            body.emit(0x03, random.choice(pointers), random.choice(sources), 0);
+        }
+        else if (kind < 0.75)
+        {
+            body.emit(random.range(9, 14), is_defined ? t : random.choice(defined), random.choice(sources), 0);
+        }
+        else if (kind < 0.82)
+        {
+            body.emit(0x00, t, 0, random.range(-32768, 32768));
+            if (!is_defined)
+            {
+                defined.push_back(t);
+            }
+        }
+        else if (kind < 0.88)
+        {
+            body.emit(0x01, t, random.choice(sources), 0);
+            if (!is_defined)
+            {
+                defined.push_back(t);
+            }
+        }
+        else if (kind < 0.94)
+        {
+            if (is_defined)
+            {
+                body.emit(random.real() < 0.5 ? 0x0E : 0x0F, t, 0, random.range(0, 40) << 8);
+            }
+        }
+        else if (!clean)
+        {
+            // Algo que quebra o padrão
+            body.emit(random.choice(vector<uint8_t>{9, 2, 1}), random.range(0, 13), random.range(0, 16), 0);
+        }
+    }
+    bool stores = false;
+    for (size_t i = 0; i < body.bytes.size(); i += INSTRUCTION_SIZE)
+    {
+        stores |= body.bytes[i] == 0x03;
+    }
+    if (!stores)
+    {
+        vector<uint8_t> sources = defined;
+        sources.insert(sources.end(), invariants.begin(), invariants.end());
+        body.emit(0x03, random.choice(pointers), random.choice(sources), 0);
+    }
+    for (uint8_t p : pointers)
+    {
+        uint32_t at = random.range(0, body.size() + 1) * INSTRUCTION_SIZE;
+        uint8_t opcode = stride_value < 0 && random.real() < 0.8 ? 0x0A : 0x09;
+        uint8_t update[INSTRUCTION_SIZE] = {opcode, (uint8_t)((p << 4) | stride), 0, 0};
+        body.bytes.insert(body.bytes.begin() + at, update, update + INSTRUCTION_SIZE);
+    }
+    if (body.size() > 12)
+    {
+        body.bytes.resize(12 * INSTRUCTION_SIZE);
+    }
+    body.emit((down == (step_value > 0)) ? 0x0A : 0x09, counter, step, 0);
+    program.bytes.insert(program.bytes.end(), body.bytes.begin(), body.bytes.end());
+
+    // down: cmp counter, bound; jg. up: cmp counter, bound; jl. Os trocados
+    // comparam bound com counter e usam o salto oposto.
+    bool swapped = mode >= 2;
+    program.emit(0x04, swapped ? bound : counter, swapped ? counter : bound, 0);
+    program.jump(down != swapped ? 0x06 : 0x07, inner);
+    program.emit(0x0A, 15, 14, 0);
+    program.emit(0x04, 15, 13, 0);
+    program.jump(0x06, outer);
+
+    // Checksum de toda a memória em r0: r0 = (r0 << 1) ^ MEM[r1], r1 += 4
+    program.emit(0x00, 1, 0, 0);
+    program.emit(0x00, 0, 0, 0);
+    program.emit(0x00, 2, 0, 4);
+    uint32_t checksum = program.size();
+    program.emit(0x02, 3, 1, 0);
+    program.emit(0x0E, 0, 0, 1 << 8);
+    program.emit(0x0D, 0, 3, 0);
+    program.emit(0x09, 1, 2, 0);
+    uint32_t limit = memory_size - 4;
+    if (limit < 0x8000)
+    {
+        program.emit(0x00, 3, 0, limit);
+    }
+    else
+    {
+        // 0xFFFC = 0x7FFC << 1 | 4
+        program.emit(0x00, 3, 0, 0x7FFC);
+        program.emit(0x0E, 3, 0, 1 << 8);
+        program.emit(0x0C, 3, 2, 0);
+    }
+    program.emit(0x04, 3, 1, 0);
+    program.jump(0x06, checksum);
+    return program;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || (strcmp(argv[1], "code") != 0 && strcmp(argv[1], "vector") != 0))
+    {
+        fprintf(stderr, "usage: %s code|vector seed [mem_bits]\n", argv[0]);
+        return 1;
+    }
+    Random random = {strtoull(argv[2], nullptr, 10) * 0x100000001B3ull};
+    uint32_t memory_bits = argc > 3 ? atoi(argv[3]) : 16;
+    // O checksum só cobre memórias de até 64 KB
+    uint32_t memory_size = 1u << min<uint32_t>(memory_bits, 16);
+
+    Program program = strcmp(argv[1], "code") == 0 ? generate_code(random) : generate_vector(random, memory_size);
+    for (size_t i = 0; i < program.bytes.size(); i++)
+    {
+        printf(i + 1 < program.bytes.size() ? "0x%02X " : "0x%02X\n", program.bytes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,274 @@
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+
+using namespace std;
+
+// Gerador de programas PQP para o benchmark. Todos os programas têm a mesma
+// forma: inicialização, um laço de N iterações com um corpo que depende do tipo
+// e a saída pelo fim do programa.
+//
+//   pqp_gen arith|memcpy|transform|branch|cmpchain N > programa.txt
+//
+// memcpy e transform usam endereços até 0x2FFF, então precisa de --mem-bits 14 ou mais.
+
+#define INSTRUCTION_SIZE 4
+
+struct Program
+{
+    vector<uint8_t> bytes;
+
+    uint32_t pc()
+    {
+        return bytes.size();
+    }
+
+    void emit(uint8_t opcode, uint8_t rx, uint8_t ry, int16_t imm)
+    {
+        bytes.push_back(opcode);
+        bytes.push_back((rx << 4) | ry);
+        bytes.push_back(imm & 0xFF);
+        bytes.push_back((imm >> 8) & 0xFF);
+    }
+
+    void mov(uint8_t rx, int16_t imm) { emit(0x00, rx, 0, imm); }
+    void mov_r(uint8_t rx, uint8_t ry) { emit(0x01, rx, ry, 0); }
+    void load(uint8_t rx, uint8_t ry) { emit(0x02, rx, ry, 0); }
+    void store(uint8_t rx, uint8_t ry) { emit(0x03, rx, ry, 0); }
+    void cmp(uint8_t rx, uint8_t ry) { emit(0x04, rx, ry, 0); }
+    void add(uint8_t rx, uint8_t ry) { emit(0x09, rx, ry, 0); }
+    void sub(uint8_t rx, uint8_t ry) { emit(0x0A, rx, ry, 0); }
+    void and_r(uint8_t rx, uint8_t ry) { emit(0x0B, rx, ry, 0); }
+    void or_r(uint8_t rx, uint8_t ry) { emit(0x0C, rx, ry, 0); }
+    void xor_r(uint8_t rx, uint8_t ry) { emit(0x0D, rx, ry, 0); }
+    // O deslocamento fica no último byte da instrução
+    void sal(uint8_t rx, uint8_t shift) { emit(0x0E, rx, 0, shift << 8); }
+    void sar(uint8_t rx, uint8_t shift) { emit(0x0F, rx, 0, shift << 8); }
+
+    // jmp/jg/jl/je para um pc absoluto
+    void jump(uint8_t opcode, uint32_t target)
+    {
+        emit(opcode, 0, 0, (int16_t)(target - (pc() + INSTRUCTION_SIZE)));
+    }
+
+    // Salto para frente ainda sem alvo; o offset é preenchido por patch()
+    uint32_t jump_forward(uint8_t opcode)
+    {
+        uint32_t at = pc();
+        emit(opcode, 0, 0, 0);
+        return at;
+    }
+
+    void patch(uint32_t at)
+    {
+        int16_t offset = pc() - (at + INSTRUCTION_SIZE);
+        bytes[at + 2] = offset & 0xFF;
+        bytes[at + 3] = (offset >> 8) & 0xFF;
+    }
+
+    // rx = value de 32 bits, montado byte a byte (mov i16 estende o sinal)
+    void mov32(uint8_t rx, uint8_t scratch, uint32_t value)
+    {
+        mov(rx, (value >> 24) & 0xFF);
+        for (int shift = 16; shift >= 0; shift -= 8)
+        {
+            sal(rx, 8);
+            mov(scratch, (value >> shift) & 0xFF);
+            or_r(rx, scratch);
+        }
+    }
+};
+
+// R15 conta as iterações, R14 = 1 e R13 = 0 nos quatro programas
+static void loop_begin(Program &program, uint32_t iterations)
+{
+    program.mov32(15, 14, iterations);
+    program.mov(14, 1);
+    program.mov(13, 0);
+}
+
+static void loop_end(Program &program, uint32_t loop)
+{
+    program.sub(15, 14);
+    program.cmp(15, 13);
+    program.jump(0x06, loop);
+}
+
+// Só ALU: uma cadeia de dependências com todas as operações de registrador
+static void arith(Program &program, uint32_t iterations)
+{
+    program.mov(1, 3);
+    program.mov(2, 5);
+    loop_begin(program, iterations);
+
+    uint32_t loop = program.pc();
+    program.add(1, 2);
+    program.xor_r(3, 1);
+    program.sub(4, 3);
+    program.and_r(5, 1);
+    program.or_r(6, 4);
+    program.mov_r(7, 6);
+    program.sal(7, 3);
+    program.sar(8, 1);
+    program.add(2, 14);
+    loop_end(program, loop);
+}
+
+// Cópia de uma palavra por iteração de 0x1000 para 0x2000, dando a volta em 4 KB
+static void memcpy_loop(Program &program, uint32_t iterations)
+{
+    program.mov(4, 4);
+    program.mov(9, 0x0FFC);
+    program.mov(10, 0x1000);
+    program.mov(11, 0x2000);
+    program.mov(6, 0);
+    loop_begin(program, iterations);
+
+    uint32_t loop = program.pc();
+    program.mov_r(1, 6);
+    program.or_r(1, 10);
+    program.mov_r(2, 6);
+    program.or_r(2, 11);
+    program.load(3, 1);
+    program.add(3, 14);
+    program.store(2, 3);
+    program.add(6, 4);
+    program.and_r(6, 9);
+    loop_end(program, loop);
+}
+
+// Transformação elemento a elemento de 1024 palavras de 0x1000 para 0x2000
+// (y = (x + R5) ^ R7), repetida até somar o número de iterações pedido
+static void transform(Program &program, uint32_t iterations)
+{
+    program.mov(4, 4);
+    program.mov(5, 0x1234);
+    program.mov(7, 0x5A5A);
+    loop_begin(program, iterations / 1024 > 0 ? iterations / 1024 : 1);
+
+    uint32_t loop = program.pc();
+    program.mov(1, 0x1000);
+    program.mov(2, 0x2000);
+    program.mov(12, 1024);
+
+    uint32_t element = program.pc();
+    program.load(3, 1);
+    program.add(3, 5);
+    program.xor_r(3, 7);
+    program.store(2, 3);
+    program.add(1, 4);
+    program.add(2, 4);
+    program.sub(12, 14);
+    program.cmp(12, 13);
+    program.jump(0x06, element);
+    loop_end(program, loop);
+}
+
+// Saltos dependentes de dados: um xorshift decide cada desvio
+static void branch(Program &program, uint32_t iterations)
+{
+    program.mov(1, 0x1234);
+    program.mov(12, 1);
+    program.mov(11, 2);
+    loop_begin(program, iterations);
+
+    uint32_t loop = program.pc();
+    program.mov_r(2, 1);
+    program.sal(2, 13);
+    program.xor_r(1, 2);
+    program.mov_r(2, 1);
+    program.sar(2, 17);
+    program.xor_r(1, 2);
+    program.mov_r(2, 1);
+    program.sal(2, 5);
+    program.xor_r(1, 2);
+
+    program.mov_r(3, 1);
+    program.and_r(3, 12);
+    program.cmp(3, 13);
+    uint32_t skip_odd = program.jump_forward(0x08);
+    program.add(4, 14);
+    program.patch(skip_odd);
+
+    program.mov_r(3, 1);
+    program.and_r(3, 11);
+    program.cmp(3, 13);
+    uint32_t skip_bit = program.jump_forward(0x06);
+    program.add(5, 14);
+    uint32_t join = program.jump_forward(0x05);
+    program.patch(skip_bit);
+    program.sub(5, 14);
+    program.patch(join);
+    loop_end(program, loop);
+}
+
+// Oito pares cmp/je seguidos comparando um contador cíclico com constantes
+static void cmpchain(Program &program, uint32_t iterations)
+{
+    // R0..R7 = 0..7, R8 = contador cíclico (R7 também é a máscara)
+    for (uint8_t r = 0; r < 8; r++)
+    {
+        program.mov(r, r);
+    }
+    program.mov(8, 0);
+    loop_begin(program, iterations);
+
+    uint32_t loop = program.pc();
+    program.add(8, 14);
+    program.and_r(8, 7);
+    for (uint8_t r = 0; r < 8; r++)
+    {
+        program.cmp(8, r);
+        uint32_t skip = program.jump_forward(0x08);
+        program.add(9, 14);
+        program.patch(skip);
+    }
+    loop_end(program, loop);
+}
+
+int main(int argc, char *argv[])
+{
+    Program program;
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s arith|memcpy|transform|branch|cmpchain iterations\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t iterations = strtoul(argv[2], nullptr, 0);
+    if (strcmp(argv[1], "arith") == 0)
+    {
+        arith(program, iterations);
+    }
+    else if (strcmp(argv[1], "memcpy") == 0)
+    {
+        memcpy_loop(program, iterations);
+    }
+    else if (strcmp(argv[1], "transform") == 0)
+    {
+        transform(program, iterations);
+    }
+    else if (strcmp(argv[1], "branch") == 0)
+    {
+        branch(program, iterations);
+    }
+    else if (strcmp(argv[1], "cmpchain") == 0)
+    {
+        cmpchain(program, iterations);
+    }
+    else
+    {
+        fprintf(stderr, "unknown program %s\n", argv[1]);
+        return 1;
+    }
+
+    for (size_t i = 0; i < program.bytes.size(); i++)
+    {
+        // Uma instrução por linha, como no input.txt
+        printf("%02X%c", program.bytes[i], i % INSTRUCTION_SIZE == INSTRUCTION_SIZE - 1 ? '\n' : ' ');
+    }
+    return 0;
+}
@@ -0,0 +1,348 @@
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+
+using namespace std;
+
+// Interpretador de referência do PQP para o teste diferencial (bench/check.sh):
+// uma instrução por vez direto da memória, sem decodificação prévia, sem fusão
+// de cmp e sem cache, então nada do que o JIT otimiza existe aqui. Escreve a
+// mesma saída que o simple_jit_pqp.
+//
+//   pqp_ref [--mem-bits N] [--trace text|off] [--counters profile|off] [--max-steps N] input output
+//
+// --code-pages também é aceito e ignorado, para as opções do JIT servirem aqui.
+// Lê o formato texto e as imagens binárias. Sai com 2 quando o programa passa
+// de --max-steps instruções (padrão 10^7), para o gerador descartar os que não
+// terminam.
+
+#define REGISTERS_NUM 16
+#define OPCODES_NUM 16
+#define INSTRUCTION_SIZE 4
+// Mesmo excesso da memória da VM: um acesso de 4 bytes no último endereço
+#define MEMORY_GUARD 4096
+
+#define IMAGE_MAGIC "PQPI"
+#define IMAGE_VERSION 1
+
+// Cabeçalho das imagens binárias (o de pqp.cpp)
+struct Image_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t entry_pc;
+    uint32_t code_size;
+    uint32_t data_size;
+    uint32_t image_offset;
+    uint32_t reserved[2];
+};
+
+struct Reference
+{
+    uint64_t memory_size;
+    uint32_t memory_mask;
+    vector<uint8_t> memory;
+    uint32_t program_size;
+    uint32_t pc;
+    int32_t registers[REGISTERS_NUM];
+    // Operandos do último cmp; {1, 0} antes do primeiro, então só o jg salta
+    int32_t compare[2];
+    uint64_t instruction_counts[OPCODES_NUM];
+    // O log tem só a primeira execução de cada pc
+    vector<bool> logged;
+};
+
+static bool load(Reference &vm, const char *path)
+{
+    FILE *input = fopen(path, "rb");
+    Image_header header;
+
+    if (input == nullptr)
+    {
+        return false;
+    }
+    vm.pc = 0;
+    vm.program_size = 0;
+    if (fread(&header, sizeof(header), 1, input) == 1 && memcmp(header.magic, IMAGE_MAGIC, 4) == 0)
+    {
+        uint64_t size = (uint64_t)header.code_size + header.data_size;
+        if (header.version != IMAGE_VERSION || header.reserved[0] != 0 || header.reserved[1] != 0 ||
+            fseek(input, header.image_offset, SEEK_SET) != 0)
+        {
+            fclose(input);
+            return false;
+        }
+        if (size > vm.memory_size)
+        {
+            size = vm.memory_size;
+        }
+        vm.program_size = fread(vm.memory.data(), 1, size, input);
+        vm.pc = header.entry_pc;
+        fclose(input);
+        return vm.program_size == size && vm.pc % 4 == 0 && (vm.pc < size || vm.pc == 0);
+    }
+
+    rewind(input);
+    unsigned value;
+    while (vm.program_size < vm.memory_size && fscanf(input, "%x", &value) == 1)
+    {
+        vm.memory[vm.program_size++] = (uint8_t)value;
+    }
+    fclose(input);
+    return true;
+}
+
+// Destino de salto e pc de saída como o JIT os escreve: 16 bits com memória de até 64 KB
+static uint32_t trace_pc(const Reference &vm, uint32_t pc)
+{
+    return vm.memory_size <= 0x10000 ? (uint16_t)pc : pc;
+}
+
+static int32_t read_word(const Reference &vm, uint32_t address)
+{
+    int32_t value;
+    memcpy(&value, &vm.memory[address], sizeof(value));
+    return value;
+}
+
+// Executa até o fim do programa; false se passou de max_steps
+static bool run(Reference &vm, FILE *output, bool trace, uint64_t max_steps)
+{
+    static const char *const jumps[] = {"JG", "JL", "JE"};
+
+    for (uint64_t step = 0; vm.pc < vm.program_size && vm.memory[vm.pc] < OPCODES_NUM; step++)
+    {
+        if (step == max_steps)
+        {
+            return false;
+        }
+        uint32_t pc = vm.pc;
+        uint8_t opcode = vm.memory[pc];
+        uint8_t rx = vm.memory[pc + 1] >> 4;
+        uint8_t ry = vm.memory[pc + 1] & 0x0F;
+        int32_t imm = (int16_t)(vm.memory[pc + 2] | (vm.memory[pc + 3] << 8));
+        uint8_t shift = vm.memory[pc + 3] & 0x1F;
+        uint32_t target = pc + INSTRUCTION_SIZE + imm;
+        int32_t *r = vm.registers;
+        bool log = trace && !vm.logged[pc];
+
+        vm.logged[pc] = true;
+        vm.instruction_counts[opcode]++;
+        vm.pc = pc + INSTRUCTION_SIZE;
+        switch (opcode)
+        {
+        case 0x00:
+            if (log)
+            {
+                fprintf(output, "0x%04X->MOV_R%d=0x%08X\n", pc, rx, imm);
+            }
+            r[rx] = imm;
+            break;
+        case 0x01:
+            if (log)
+            {
+                fprintf(output, "0x%04X->MOV_R%d=R%d=0x%08X\n", pc, rx, ry, r[ry]);
+            }
+            r[rx] = r[ry];
+            break;
+        case 0x02:
+        {
+            uint32_t address = r[ry] & vm.memory_mask;
+            int32_t value = read_word(vm, address);
+            if (log)
+            {
+                fprintf(output, "0x%04X->MOV_R%d=MEM[0x%02X,0x%02X,0x%02X,0x%02X]=[0x%02X,0x%02X,0x%02X,0x%02X]\n",
+                        pc, rx, address, address + 1, address + 2, address + 3,
+                        value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, (value >> 24) & 0xFF);
+            }
+            r[rx] = value;
+            break;
+        }
+        case 0x03:
+        {
+            uint32_t address = r[rx] & vm.memory_mask;
+            int32_t value = r[ry];
+            if (log)
+            {
+                fprintf(output, "0x%04X->MOV_MEM[0x%02X,0x%02X,0x%02X,0x%02X]=R%d=[0x%02X,0x%02X,0x%02X,0x%02X]\n",
+                        pc, address, address + 1, address + 2, address + 3, ry,
+                        value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, (value >> 24) & 0xFF);
+            }
+            memcpy(&vm.memory[address], &value, sizeof(value));
+            break;
+        }
+        case 0x04:
+            if (log)
+            {
+                fprintf(output, "0x%04X->CMP_R%d<=>R%d(G=%d,L=%d,E=%d)\n", pc, rx, ry,
+                        r[rx] > r[ry], r[rx] < r[ry], r[rx] == r[ry]);
+            }
+            vm.compare[0] = r[rx];
+            vm.compare[1] = r[ry];
+            break;
+        case 0x05:
+            if (log)
+            {
+                fprintf(output, "0x%04X->JMP_0x%04X\n", pc, trace_pc(vm, target));
+            }
+            vm.pc = target;
+            break;
+        case 0x06:
+        case 0x07:
+        case 0x08:
+        {
+            int32_t a = vm.compare[0];
+            int32_t b = vm.compare[1];
+            if (log)
+            {
+                fprintf(output, "0x%04X->%s_0x%04X\n", pc, jumps[opcode - 0x06], trace_pc(vm, target));
+            }
+            if (opcode == 0x06 ? a > b : opcode == 0x07 ? a < b : a == b)
+            {
+                vm.pc = target;
+            }
+            break;
+        }
+        case 0x09:
+            if (log)
+            {
+                fprintf(output, "0x%04X->ADD_R%d+=R%d=0x%08X+0x%08X=0x%08X\n", pc, rx, ry, r[rx], r[ry],
+                        (int32_t)((uint32_t)r[rx] + r[ry]));
+            }
+            r[rx] = (uint32_t)r[rx] + r[ry];
+            break;
+        case 0x0A:
+            if (log)
+            {
+                fprintf(output, "0x%04X->SUB_R%d-=R%d=0x%08X-0x%08X=0x%08X\n", pc, rx, ry, r[rx], r[ry],
+                        (int32_t)((uint32_t)r[rx] - r[ry]));
+            }
+            r[rx] = (uint32_t)r[rx] - r[ry];
+            break;
+        case 0x0B:
+            if (log)
+            {
+                fprintf(output, "0x%04X->AND_R%d&=R%d=0x%08X&0x%08X=0x%08X\n", pc, rx, ry, r[rx], r[ry], r[rx] & r[ry]);
+            }
+            r[rx] &= r[ry];
+            break;
+        case 0x0C:
+            if (log)
+            {
+                fprintf(output, "0x%04X->OR_R%d|=R%d=0x%08X|0x%08X=0x%08X\n", pc, rx, ry, r[rx], r[ry], r[rx] | r[ry]);
+            }
+            r[rx] |= r[ry];
+            break;
+        case 0x0D:
+            if (log)
+            {
+                fprintf(output, "0x%04X->XOR_R%d^=R%d=0x%08X^0x%08X=0x%08X\n", pc, rx, ry, r[rx], r[ry], r[rx] ^ r[ry]);
+            }
+            r[rx] ^= r[ry];
+            break;
+        case 0x0E:
+            if (log)
+            {
+                fprintf(output, "0x%04X->SAL_R%d<<=%d=0x%08X<<%d=0x%08X\n", pc, rx, shift, r[rx], shift,
+                        (int32_t)((uint32_t)r[rx] << shift));
+            }
+            r[rx] = (uint32_t)r[rx] << shift;
+            break;
+        case 0x0F:
+            if (log)
+            {
+                fprintf(output, "0x%04X->SAR_R%d>>=%d=0x%08X>>%d=0x%08X\n", pc, rx, shift, r[rx], shift, r[rx] >> shift);
+            }
+            r[rx] >>= shift;
+            break;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t memory_bits = 8;
+    bool trace = true;
+    bool counted = true;
+    uint64_t max_steps = 10000000;
+    int arg = 1;
+
+    while (arg + 1 < argc && strncmp(argv[arg], "--", 2) == 0)
+    {
+        if (strcmp(argv[arg], "--mem-bits") == 0)
+        {
+            memory_bits = atoi(argv[arg + 1]);
+        }
+        else if (strcmp(argv[arg], "--trace") == 0)
+        {
+            trace = strcmp(argv[arg + 1], "off") != 0;
+        }
+        else if (strcmp(argv[arg], "--counters") == 0)
+        {
+            counted = strcmp(argv[arg + 1], "off") != 0;
+        }
+        else if (strcmp(argv[arg], "--max-steps") == 0)
+        {
+            max_steps = strtoull(argv[arg + 1], nullptr, 10);
+        }
+        else if (strcmp(argv[arg], "--code-pages") != 0)
+        {
+            break;
+        }
+        arg += 2;
+    }
+    if (arg + 2 != argc || memory_bits < 8 || memory_bits > 32)
+    {
+        fprintf(stderr, "usage: %s [--mem-bits 8-32] [--trace text|off] [--counters profile|off] [--max-steps N] input output\n",
+                argv[0]);
+        return 1;
+    }
+
+    Reference vm;
+    vm.memory_size = 1ull << memory_bits;
+    vm.memory_mask = (uint32_t)(vm.memory_size - 1);
+    vm.memory.assign(vm.memory_size + MEMORY_GUARD, 0);
+    memset(vm.registers, 0, sizeof(vm.registers));
+    vm.compare[0] = 1;
+    vm.compare[1] = 0;
+    memset(vm.instruction_counts, 0, sizeof(vm.instruction_counts));
+    if (!load(vm, argv[arg]))
+    {
+        fprintf(stderr, "cannot load %s\n", argv[arg]);
+        return 1;
+    }
+    vm.logged.assign(vm.program_size, false);
+
+    FILE *output = fopen(argv[arg + 1], "w");
+    if (output == nullptr)
+    {
+        fprintf(stderr, "cannot open %s\n", argv[arg + 1]);
+        return 1;
+    }
+    if (!run(vm, output, trace, max_steps))
+    {
+        fclose(output);
+        return 2;
+    }
+
+    fprintf(output, "0x%04X->EXIT\n", trace_pc(vm, vm.pc));
+    if (counted)
+    {
+        fprintf(output, "[");
+        for (int i = 0; i < OPCODES_NUM - 1; i++)
+        {
+            fprintf(output, "%02X:%u,", i, (uint32_t)vm.instruction_counts[i]);
+        }
+        fprintf(output, "0F:%u]\n", (uint32_t)vm.instruction_counts[OPCODES_NUM - 1]);
+    }
+    fprintf(output, "[");
+    for (int i = 0; i < REGISTERS_NUM - 1; i++)
+    {
+        fprintf(output, "R%d=0x%08X,", i, vm.registers[i]);
+    }
+    fprintf(output, "R15=0x%08X]", vm.registers[REGISTERS_NUM - 1]);
+    return fclose(output) == 0 ? 0 : 1;
+}
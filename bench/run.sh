@@ -0,0 +1,52 @@
+#!/bin/sh
+# Benchmark dos programas gerados por pqp_gen.cpp em uma ou mais builds do JIT.
+#
+#   bench/run.sh [-n iterações] [-r repetições] nome=binário [nome=binário ...]
+#
+# O binário pode vir com opções, entre aspas, para comparar modos da mesma
+# build: bench/run.sh wx=./simple_jit_pqp "rwx=./simple_jit_pqp --code-pages rwx"
+#
+# Cada execução gera uma linha JSON em stdout (a saída de --stats do JIT com
+# "variant" e "workload" acrescentados), então dá para guardar o resultado e
+# comparar com o de outra versão. Sem --trace, só o código gerado é medido.
+
+set -e
+
+iterations=10000000
+repeat=3
+while getopts n:r: option; do
+    case $option in
+    n) iterations=$OPTARG ;;
+    r) repeat=$OPTARG ;;
+    *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [-n iterations] [-r repeat] name=binary [options] ..." >&2
+    exit 1
+fi
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+g++ -std=c++11 -O2 -o "$work/pqp_gen" "$(dirname "$0")/pqp_gen.cpp"
+workloads="arith memcpy transform branch cmpchain"
+for workload in $workloads; do
+    "$work/pqp_gen" $workload $iterations > "$work/$workload.txt"
+done
+
+for variant in "$@"; do
+    name=${variant%%=*}
+    binary=${variant#*=}
+    for workload in $workloads; do
+        i=0
+        while [ $i -lt $repeat ]; do
+            rm -f "$work/stats.jsonl"
+            $binary --mem-bits 16 --trace off --stats "$work/stats.jsonl" \
+                "$work/$workload.txt" "$work/output.txt"
+            sed "s/^{/{\"variant\":\"$name\",\"workload\":\"$workload\",/" "$work/stats.jsonl"
+            i=$((i + 1))
+        done
+    done
+done
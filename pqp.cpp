@@ -0,0 +1,4218 @@
+#include "pqp.h"
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <cstdint>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <time.h>
+#include <x86intrin.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+#define REGISTERS_NUM 16
+#define OPCODES_NUM 16
+#define INSTRUCTION_SIZE 4
+
+// Execução em camadas: um bloco é interpretado nas primeiras TIER1_THRESHOLD - 1
+// entradas e compilado na seguinte; um laço compilado que dá TIER2_THRESHOLD
+// voltas é recompilado inteiro como uma região contínua
+#define TIER1_THRESHOLD 3
+#define TIER2_THRESHOLD 1000
+
+// instruction_counts: contadores por opcode, o orçamento de passos do código
+// nativo, os dois campos de uma saída por escrita no código, um contador de
+// calor por pc e o mapa de bytes de código (seguidos dos contadores de bloco)
+#define BUDGET_SLOT OPCODES_NUM
+#define SMC_ADDRESS_SLOT (OPCODES_NUM + 1)
+#define SMC_PROFILE_SLOT (OPCODES_NUM + 2)
+#define HOTNESS_BASE (OPCODES_NUM + 3)
+#define NO_SMC 0xFFFFFFFF
+
+// Código automodificável: um byte de marca por byte do programa, não zero nos
+// bytes de instruções já decodificadas ou compiladas. Só um store que atinge
+// um deles sai do código nativo; os que caem em dados ao lado do código, não.
+
+// Os endereços da VM são mascarados, e a página extra no fim cobre os até 3
+// bytes que um acesso de 4 bytes no último endereço lê além da máscara
+#define MEMORY_GUARD 4096
+// Até este tamanho a memória é zerada com memset ao reiniciar a VM; acima, as
+// páginas são devolvidas ao kernel de uma vez
+#define RESET_MEMSET_LIMIT (64 * 1024)
+
+// Imagem binária: cabeçalho seguido do código e dos dados (contíguos a partir do
+// endereço 0 da VM) num offset alinhado à página, para ser mapeada sem cópia
+#define IMAGE_MAGIC "PQPI"
+#define IMAGE_VERSION 1
+#define IMAGE_ALIGN 4096
+
+// Log binário: registros de tamanho fixo acumulados num buffer grande e
+// escritos (ou decodificados para texto) só quando ele enche
+#define TRACE_MAGIC "PQPT"
+#define TRACE_VERSION 2
+#define TRACE_BUFFER_RECORDS (64 * 1024)
+#define TRACE_EXIT 0xFF
+
+// Cache de código: espaço de endereços reservado de uma vez (mantém todos os
+// saltos ao alcance de um rel32) e liberado para uso em regiões conforme cresce
+#define CODE_CACHE_SIZE (64 * 1024 * 1024)
+#define CODE_REGION_SIZE (64 * 1024)
+#define CODE_PAGE_SIZE 4096
+// Maior código emitido por uma instrução, incluindo as saídas do bloco e as
+// constantes adiadas que ela escreve antes de sair (até 16 mov de 7 bytes)
+#define MAX_INSTRUCTION_CODE 256
+
+// Cache de código em disco: um arquivo por programa, identificado por um hash
+// da imagem, da configuração da VM e da versão do compilador. Mudou o código
+// gerado, incremente CODE_CACHE_VERSION.
+#define CODE_CACHE_MAGIC "PQPC"
+#define CODE_CACHE_VERSION 13
+#define CODE_CACHE_ALIGN 4096
+
+// Registradores x86-64 callee-saved que podem guardar registradores PQP
+// durante uma região compilada: rbx, rbp, r12, r13, r14, r15
+#define HOST_REGISTERS_NUM 6
+#define NO_HOST_REGISTER 0xFF
+// Registradores x86-64 livres dentro do código gerado (r8 só serve ao prólogo e
+// r11 ao despacho indireto), usados só dentro de um laço desenrolado
+#define LOOP_REGISTERS_NUM 2
+
+// Laços de um caminho só são desenrolados na camada 2: até MAX_UNROLL cópias do
+// corpo, sem passar de UNROLL_INSTRUCTIONS instruções
+#define MAX_UNROLL 8
+#define UNROLL_INSTRUCTIONS 32
+
+// Laços elemento a elemento sobre a memória (palavras seguidas, passo 4) ganham
+// na camada 2 uma versão vetorial: vector_lanes voltas por bloco, com o
+// registrador PQP r em xmm/ymm r. Até MAX_VECTOR_ACCESSES loads e stores.
+#define MAX_VECTOR_ACCESSES 8
+#define MAX_VECTOR_CODE 4096
+#define VECTOR_MEMORY 0xFF
+// vvvv sem registrador no VEX: 1111, o complemento de 0
+#define VECTOR_NO_SOURCE 0
+
+// Prólogo, epílogo e despacho indireto ficam no início do cache de código
+#define PROLOGUE_OFFSET 0
+#define NO_COMPARE 0xFFFFFFFF
+// Até quantas instruções antes do jcc o cmp fundido pode estar
+#define FUSE_DISTANCE 16
+
+using JitFunc = uintptr_t (*)(int32_t *, uint32_t *, uint8_t *, int32_t *, uint8_t *);
+
+static const uint8_t host_registers[HOST_REGISTERS_NUM] = {3, 5, 12, 13, 14, 15};
+static const uint8_t loop_host_registers[LOOP_REGISTERS_NUM] = {8, 11};
+
+struct Image_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t entry_pc;
+    uint32_t code_size;
+    uint32_t data_size;
+    uint32_t image_offset;
+    // Zerados; imagens com outro valor são recusadas
+    uint32_t reserved[2];
+};
+
+// Um registro por instrução logada; a e b guardam os valores que a linha de
+// texto precisa, o resto (flags do cmp, resultado das operações) o decodificador
+// recalcula
+struct Trace_record
+{
+    uint32_t pc;
+    uint8_t opcode;
+    uint8_t operands;
+    uint16_t reserved;
+    int32_t a;
+    int32_t b;
+};
+
+// Fim do log binário: depois do registro TRACE_EXIT
+struct Trace_trailer
+{
+    // 0 no modo sem contadores: a linha de contagem não é gerada
+    uint32_t counted;
+    uint32_t instruction_counts[16];
+    int32_t registers[REGISTERS_NUM];
+};
+
+struct Trace_writer
+{
+    Trace_mode mode;
+    FILE *output;
+    vector<Trace_record> buffer;
+    uint32_t used;
+};
+
+struct Code_cache_header
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t program_size;
+    uint32_t code_size;
+    uint32_t code_offset;
+    uint32_t epilogue;
+    uint32_t dispatch;
+    uint32_t relocations_num;
+    uint32_t profile_blocks_num;
+    uint32_t profile_opcodes_num;
+    uint32_t exits_num;
+    uint32_t code_marks_num;
+    // Seguido de relocations_num offsets de relocação, de program_size offsets
+    // de blocos (0 = pc não compilado), de program_size Cached_loop (o que o
+    // compilador sabe do laço com cabeça em cada pc), dos blocos do modo perfil,
+    // de exits_num pares (saída, pc) ainda não ligados e do mapa de bytes de
+    // código; o código fica em code_offset
+};
+
+// Pc_entry::loop_end e optimized no cache em disco: sem eles um bloco vindo do
+// cache nunca seria recompilado como região
+struct Cached_loop
+{
+    uint32_t loop_end;
+    uint32_t optimized;
+};
+
+// Programa decodificado, um array por campo indexado por pc (qualquer byte pode
+// ser destino de salto). É feito uma vez em pqp_compile(), a partir de
+// analyzed_code, e refeito só onde um store muda o código; o interpretador, o
+// log e o compilador leem os campos daqui em vez de extraí-los dos bytes.
+struct Decoded_program
+{
+    vector<uint8_t> opcode;
+    vector<uint8_t> rx;
+    vector<uint8_t> ry;
+    // Imediato do mov com o sinal estendido, ou a contagem (& 0x1F) de sal/sar
+    vector<int32_t> imm;
+    // Nos saltos: o pc de destino e o cmp refeito quando o jcc é fundido, ou
+    // NO_COMPARE
+    vector<uint32_t> target;
+    vector<uint32_t> compare;
+};
+
+// Código gerado por uma chamada de compile_block(): as instruções de
+// [start_pc, end_pc), o código em [code_start, code_end) e os pontos de entrada
+// (pc, offset) que foram para a tabela de despacho
+struct Compiled_block
+{
+    uint32_t start_pc;
+    uint32_t end_pc;
+    uint32_t code_start;
+    uint32_t code_end;
+    vector<pair<uint32_t, uint32_t>> entries;
+};
+
+// Entrada da tabela de despacho: tudo o que o despachante e o compilador
+// consultam sobre um pc, numa linha de 16 bytes. O despacho do código gerado lê
+// native com um só load indexado (emit_prologue()).
+struct Pc_entry
+{
+    // Início do bloco compilado para pc, ou nullptr
+    uint8_t *native;
+    // Fim (exclusivo) do laço com cabeça em pc, ou 0
+    uint32_t loop_end;
+    bool not_interpreted;
+    bool jump_target;
+    // O laço com cabeça em pc já foi recompilado como região
+    bool optimized;
+    // Os bytes da instrução estão marcados em code_marks e a decodificação
+    // confere com a memória (watch_instruction())
+    bool watched;
+};
+static_assert(sizeof(Pc_entry) == 16, "o despacho gerado indexa a tabela por pc*16");
+
+// Registrador PQP mantido num registrador host só durante um laço desenrolado
+struct Loop_register
+{
+    uint8_t r;
+    uint8_t host;
+    bool written;
+};
+
+struct Machine_x86
+{
+    vector<int32_t> registers;
+    uint8_t *memory;
+    uint64_t memory_size;
+    uint32_t memory_mask;
+    uint32_t program_size;
+    uint32_t entry_pc;
+    // Operandos do último cmp cujas flags um jcc não fundido pode ler: as flags
+    // não são guardadas, o jcc compara os dois de novo. Antes do primeiro cmp
+    // vale {1, 0} (só jg salta).
+    int32_t compare[2];
+    // Contadores por opcode, o orçamento de passos (BUDGET_SLOT), a última
+    // escrita no código (SMC_*_SLOT), um contador de calor por pc (HOTNESS_BASE),
+    // que conta para baixo: entradas até compilar o bloco, depois voltas até
+    // otimizar o laço, e o mapa de bytes de código em code_marks palavras
+    // (code_marks_base())
+    vector<uint32_t> instruction_counts;
+    uint32_t code_marks;
+    // Sem contadores (modo rápido) ou com um contador por bloco (modo perfil):
+    // profile_blocks[b] é o início dos opcodes do bloco b em profile_opcodes
+    bool count_instructions;
+    vector<uint32_t> profile_blocks;
+    vector<uint8_t> profile_opcodes;
+    Decoded_program decoded;
+    // Bytes do programa como as análises e o código gerado os viram. Um store que
+    // os muda invalida só os blocos atingidos, ou tudo se mudou um cmp, um salto
+    // ou o fim do programa (as análises dependem deles).
+    vector<uint8_t> analyzed_code;
+    vector<Compiled_block> blocks;
+    // O programa escreveu no próprio código (ou pqp_set_register() desfez uma
+    // fusão): o cache em disco não é gravado
+    bool code_modified;
+    // Há blocos vindos do cache em disco, que não estão em blocks
+    bool cached_blocks;
+
+    uint8_t *executable_code;
+    uint32_t code_size;
+    uint32_t code_committed;
+    // W^X: o cache fica só leitura e execução, exceto de code_unsealed até o fim
+    // enquanto um bloco é compilado (fora disso code_unsealed = code_committed).
+    // Sem W^X as regiões são RWX.
+    bool write_xor_execute;
+    uint32_t code_unsealed;
+    // Instruções PQP compiladas (estatística do benchmark)
+    uint32_t compiled_instructions;
+    // Uma entrada por pc. As tabelas por pc cobrem só o programa carregado: a VM
+    // para em pc >= program_size.
+    vector<Pc_entry> dispatch_table;
+
+    // host_register[r] é o registrador x86-64 que guarda Rr, ou NO_HOST_REGISTER
+    uint8_t host_register[REGISTERS_NUM];
+    // Enquanto um laço desenrolado é compilado: os registradores dele em
+    // r8d/r11d, carregados na entrada do laço e, se escritos, devolvidos ao
+    // array em cada saída
+    vector<Loop_register> loop_registers;
+    // Voltas por bloco dos laços vetorizados: 8 com AVX2 (ymm), senão 4 (SSE2)
+    uint32_t vector_lanes;
+    // Busca de flags_observed(): visited_pcs[pc] == visit_generation marca os pcs
+    // já vistos pela chamada atual. O array é zerado só em decode_program(), então
+    // compilar um cmp custa o que a busca visita, não o tamanho do programa.
+    vector<uint32_t> visited_pcs;
+    uint32_t visit_generation;
+    vector<uint32_t> pending_pcs;
+    uint32_t epilogue;
+    uint32_t dispatch;
+    // pending_exits[pc] são as saídas (mov eax, pc; jmp dispatch) para pc ainda
+    // não compilado, religadas com jmp direto quando o bloco de pc existir
+    vector<vector<uint32_t>> pending_exits;
+    // Offsets no código de ponteiros absolutos para dispatch_table, o único endereço
+    // absoluto emitido; o resto são saltos relativos dentro do cache
+    vector<uint32_t> relocations;
+
+    // Execução em curso: pqp_run() continua de pc. prepared diz se pqp_compile()
+    // já rodou para o programa carregado.
+    uint32_t pc;
+    bool prepared;
+    // pcs de onde a execução retomou depois de pqp_set_register() mudar um
+    // registrador de um cmp já executado: viram destinos de salto, para o jcc
+    // seguinte ler os operandos guardados em compare em vez de refazer o cmp
+    vector<uint32_t> resume_entries;
+    Trace_mode trace_mode;
+    Trace_writer trace;
+    string cache_dir;
+    string cache_path;
+    uint64_t cache_key;
+    uint32_t cached_size;
+    uint64_t compile_ns;
+    uint64_t run_ns;
+    uint64_t run_cycles;
+    // Modo perf: um grupo do perf_event_open (líder perf_fds[perf_leader]) aberto
+    // na thread que executa, perf_thread, e lido em volta de cada entrada no
+    // código nativo. perf_fds[e] é -1 para um evento indisponível.
+    bool perf;
+    int perf_fds[PERF_EVENTS_NUM];
+    int perf_leader;
+    pid_t perf_thread;
+    // Somas por pc de entrada (perf_blocks[pc], do tamanho do programa a partir
+    // do primeiro pqp_run), do interpretador e do compilador
+    vector<Perf_block> perf_blocks;
+    Perf_block perf_interpreter;
+    Perf_block perf_compiler;
+
+    Machine_x86(uint32_t memory_bits = DEFAULT_MEMORY_BITS)
+        : registers(REGISTERS_NUM, 0),
+          memory_size((uint64_t)1 << memory_bits),
+          memory_mask((uint32_t)(memory_size - 1)),
+          program_size(0),
+          entry_pc(0),
+          compare{1, 0},
+          instruction_counts(HOTNESS_BASE, 0),
+          code_marks(0),
+          count_instructions(true),
+          code_modified(false),
+          cached_blocks(false),
+          code_size(0),
+          code_committed(0),
+          write_xor_execute(true),
+          code_unsealed(0),
+          compiled_instructions(0),
+          vector_lanes(__builtin_cpu_supports("avx2") ? 8 : 4),
+          visit_generation(0),
+          epilogue(0),
+          dispatch(0),
+          pc(0),
+          prepared(false),
+          trace_mode(TRACE_OFF),
+          cache_key(0),
+          cached_size(0),
+          compile_ns(0),
+          run_ns(0),
+          run_cycles(0),
+          perf(false),
+          perf_leader(-1),
+          perf_thread(0)
+    {
+        // Páginas só são alocadas quando tocadas, então 4 GB de memória custam o que for usado
+        // Sem espaço de endereços, o ponteiro fica nulo e pqp_create() falha
+        memory = (uint8_t *)mmap(nullptr, memory_size + MEMORY_GUARD, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        executable_code = (uint8_t *)mmap(nullptr, CODE_CACHE_SIZE, PROT_NONE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            memory = nullptr;
+        }
+        if (executable_code == MAP_FAILED)
+        {
+            executable_code = nullptr;
+        }
+
+        memset(host_register, NO_HOST_REGISTER, REGISTERS_NUM);
+        trace.mode = TRACE_OFF;
+        trace.output = nullptr;
+        trace.used = 0;
+        fill(perf_fds, perf_fds + PERF_EVENTS_NUM, -1);
+        clear_perf();
+    }
+
+    void clear_perf()
+    {
+        perf_blocks.clear();
+        memset(&perf_interpreter, 0, sizeof(perf_interpreter));
+        memset(&perf_compiler, 0, sizeof(perf_compiler));
+        perf_interpreter.pc = PERF_INTERPRETER;
+        perf_compiler.pc = PERF_COMPILER;
+    }
+
+    // Volta ao estado de uma VM recém-criada, reaproveitando a memória e o
+    // cache de código já reservados (as regiões do cache continuam liberadas).
+    // false se a memória não pôde ser refeita: a VM fica sem memória e só
+    // serve para ser destruída.
+    bool reset()
+    {
+        fill(registers.begin(), registers.end(), 0);
+        fill(instruction_counts.begin(), instruction_counts.end(), 0);
+        program_size = 0;
+        entry_pc = 0;
+        compare[0] = 1;
+        compare[1] = 0;
+        code_size = 0;
+        compiled_instructions = 0;
+        epilogue = 0;
+        dispatch = 0;
+        relocations.clear();
+        blocks.clear();
+        code_modified = false;
+        cached_blocks = false;
+        memset(host_register, NO_HOST_REGISTER, REGISTERS_NUM);
+        pc = 0;
+        prepared = false;
+        resume_entries.clear();
+        cache_path.clear();
+        cache_key = 0;
+        cached_size = 0;
+        compile_ns = run_ns = run_cycles = 0;
+        clear_perf();
+        if (trace.output != nullptr)
+        {
+            fclose(trace.output);
+        }
+        trace.mode = TRACE_OFF;
+        trace.output = nullptr;
+        trace.used = 0;
+
+        if (memory == nullptr)
+        {
+            return false;
+        }
+        if (memory_size + MEMORY_GUARD <= RESET_MEMSET_LIMIT)
+        {
+            memset(memory, 0, memory_size + MEMORY_GUARD);
+        }
+        // Também desfaz o mapeamento de uma imagem binária carregada antes. Se
+        // falhar, o que havia ali pode já ter sido desmapeado.
+        else if (mmap(memory, memory_size + MEMORY_GUARD, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+            munmap(memory, memory_size + MEMORY_GUARD);
+            memory = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    ~Machine_x86()
+    {
+        if (trace.output != nullptr)
+        {
+            fclose(trace.output);
+        }
+        if (memory != nullptr)
+        {
+            munmap(memory, memory_size + MEMORY_GUARD);
+        }
+        if (executable_code != nullptr)
+        {
+            munmap(executable_code, CODE_CACHE_SIZE);
+        }
+        for (int e = 0; e < PERF_EVENTS_NUM; e++)
+        {
+            if (perf_fds[e] >= 0)
+            {
+                close(perf_fds[e]);
+            }
+        }
+    }
+};
+
+// Garante que há bytes livres no fim do cache, liberando mais uma região se preciso
+static void reserve_code(Machine_x86 &vm, uint32_t bytes)
+{
+    while (vm.code_size + bytes > vm.code_committed)
+    {
+        // No W^X só se reserva código com o cache aberto, então a região nasce RW
+        if (vm.code_committed + CODE_REGION_SIZE > CODE_CACHE_SIZE ||
+            mprotect(vm.executable_code + vm.code_committed, CODE_REGION_SIZE,
+                     PROT_READ | PROT_WRITE | (vm.write_xor_execute ? 0 : PROT_EXEC)) != 0)
+        {
+            fprintf(stderr, "code cache full (%u bytes)\n", vm.code_committed);
+            exit(1);
+        }
+        vm.code_committed += CODE_REGION_SIZE;
+    }
+}
+
+// Abre para escrita as páginas de offset até o fim do cache. Antes de compilar,
+// offset é o fim do código (onde o bloco vai ser emitido); ligar uma saída
+// antiga só estende a janela para trás. Uma troca de permissão por bloco
+// compilado, não por instrução.
+static void unseal_code(Machine_x86 &vm, uint32_t offset)
+{
+    if (!vm.write_xor_execute)
+    {
+        return;
+    }
+
+    offset &= ~(CODE_PAGE_SIZE - 1);
+    if (offset < vm.code_unsealed)
+    {
+        if (mprotect(vm.executable_code + offset, vm.code_unsealed - offset, PROT_READ | PROT_WRITE) != 0)
+        {
+            perror("mprotect");
+            exit(1);
+        }
+        vm.code_unsealed = offset;
+    }
+}
+
+// Devolve as páginas abertas por unseal_code() (e as regiões reservadas desde
+// então) para leitura e execução
+static void seal_code(Machine_x86 &vm)
+{
+    if (!vm.write_xor_execute)
+    {
+        return;
+    }
+
+    if (vm.code_unsealed < vm.code_committed &&
+        mprotect(vm.executable_code + vm.code_unsealed, vm.code_committed - vm.code_unsealed,
+                 PROT_READ | PROT_EXEC) != 0)
+    {
+        perror("mprotect");
+        exit(1);
+    }
+    vm.code_unsealed = vm.code_committed;
+}
+
+// Prefixo REX para registradores host r8-r15 (R no campo reg, B no campo rm)
+static void emit_rex(Machine_x86 &vm, uint32_t &index, uint8_t reg, uint8_t rm)
+{
+    uint8_t rex = 0x40 | ((reg & 8) ? 0x04 : 0x00) | ((rm & 8) ? 0x01 : 0x00);
+    if (rex != 0x40)
+    {
+        vm.executable_code[index++] = rex;
+    }
+}
+
+// opcode reg, Rr - o operando é o registrador host de Rr ou dword ptr [rdi + r*4]
+static void emit_operand(Machine_x86 &vm, uint32_t &index, uint8_t opcode, uint8_t reg, uint8_t r)
+{
+    uint8_t host = vm.host_register[r];
+
+    if (host != NO_HOST_REGISTER)
+    {
+        emit_rex(vm, index, reg, host);
+        vm.executable_code[index++] = opcode;
+        vm.executable_code[index++] = 0xC0 | ((reg & 7) << 3) | (host & 7);
+    }
+    else
+    {
+        emit_rex(vm, index, reg, 0);
+        vm.executable_code[index++] = opcode;
+        vm.executable_code[index++] = 0x47 | ((reg & 7) << 3);
+        vm.executable_code[index++] = r * 4;
+    }
+}
+
+// Operação rx, ry com a forma "op r/m32, r32" (opcode) e "op r32, r/m32" (opcode + 2)
+static void emit_alu(Machine_x86 &vm, uint32_t &index, uint8_t opcode, uint8_t rx, uint8_t ry)
+{
+    if (vm.host_register[rx] != NO_HOST_REGISTER)
+    {
+        // op hx, ry
+        emit_operand(vm, index, opcode + 2, vm.host_register[rx], ry);
+    }
+    else if (vm.host_register[ry] != NO_HOST_REGISTER)
+    {
+        // op dword ptr [rdi + rx], hy
+        emit_operand(vm, index, opcode, vm.host_register[ry], rx);
+    }
+    else
+    {
+        // mov eax, dword ptr [rdi + ry]
+        emit_operand(vm, index, 0x8B, 0, ry);
+        // op dword ptr [rdi + rx], eax
+        emit_operand(vm, index, opcode, 0, rx);
+    }
+}
+
+// cmp rx, ry - só define as flags do host, quem consome decide se salva
+static void emit_compare(Machine_x86 &vm, uint32_t &index, uint8_t rx, uint8_t ry)
+{
+    if (vm.host_register[rx] != NO_HOST_REGISTER)
+    {
+        // cmp hx, ry
+        emit_operand(vm, index, 0x3B, vm.host_register[rx], ry);
+    }
+    else if (vm.host_register[ry] != NO_HOST_REGISTER)
+    {
+        // cmp dword ptr [rdi + rx], hy
+        emit_operand(vm, index, 0x39, vm.host_register[ry], rx);
+    }
+    else
+    {
+        // mov eax, dword ptr [rdi + rx]
+        emit_operand(vm, index, 0x8B, 0, rx);
+        // cmp eax, dword ptr [rdi + ry]
+        emit_operand(vm, index, 0x3B, 0, ry);
+    }
+}
+
+// Mapa de bytes de código e contadores de bloco em instruction_counts
+static uint32_t code_marks_base(Machine_x86 &vm)
+{
+    return HOTNESS_BASE + vm.program_size;
+}
+
+static uint32_t block_counters_base(Machine_x86 &vm)
+{
+    return code_marks_base(vm) + vm.code_marks;
+}
+
+// Os 4 bytes de marca a partir de address: não zero se um store de 4 bytes em
+// address atinge uma instrução já decodificada ou compilada
+static uint32_t code_marks_at(Machine_x86 &vm, uint32_t address)
+{
+    uint32_t marks;
+    memcpy(&marks, (uint8_t *)&vm.instruction_counts[code_marks_base(vm)] + address, sizeof(marks));
+    return marks;
+}
+
+// Modo perfil: cada bloco compilado conta só as suas entradas, e na saída
+// expand_profile() multiplica as entradas pelos opcodes do bloco (toda entrada
+// executa o bloco inteiro). O contador fica em instruction_counts, depois dos
+// contadores de calor.
+static void emit_block_count(Machine_x86 &vm, uint32_t &index)
+{
+    if (!vm.count_instructions)
+    {
+        return;
+    }
+
+    uint32_t disp = vm.instruction_counts.size() * 4;
+    vm.instruction_counts.push_back(0);
+    vm.profile_blocks.push_back(vm.profile_opcodes.size());
+
+    // inc dword ptr [rsi + disp32] (6 bytes)
+    vm.executable_code[index++] = 0xFF;
+    vm.executable_code[index++] = 0x86;
+    vm.executable_code[index++] = (disp >> 0) & 0xFF;
+    vm.executable_code[index++] = (disp >> 8) & 0xFF;
+    vm.executable_code[index++] = (disp >> 16) & 0xFF;
+    vm.executable_code[index++] = (disp >> 24) & 0xFF;
+}
+
+// Acrescenta uma instrução ao bloco cujas entradas emit_block_count() conta
+static void profile_opcode(Machine_x86 &vm, uint8_t opcode)
+{
+    if (vm.count_instructions)
+    {
+        vm.profile_opcodes.push_back(opcode);
+    }
+}
+
+static void expand_profile(Machine_x86 &vm)
+{
+    uint32_t base = block_counters_base(vm);
+
+    for (size_t block = 0; block < vm.profile_blocks.size(); block++)
+    {
+        uint32_t entries = vm.instruction_counts[base + block];
+        size_t end = block + 1 < vm.profile_blocks.size() ? vm.profile_blocks[block + 1] : vm.profile_opcodes.size();
+
+        for (size_t i = vm.profile_blocks[block]; i < end; i++)
+        {
+            vm.instruction_counts[vm.profile_opcodes[i]] += entries;
+        }
+        vm.instruction_counts[base + block] = 0;
+    }
+}
+
+// Limita o endereço em eax ao espaço de endereços, sem desvio condicional
+static void emit_address_mask(Machine_x86 &vm, uint32_t &index)
+{
+    if (vm.memory_mask == 0xFF)
+    {
+        // movzx eax, al (3 bytes)
+        vm.executable_code[index++] = 0x0F;
+        vm.executable_code[index++] = 0xB6;
+        vm.executable_code[index++] = 0xC0;
+    }
+    else if (vm.memory_mask == 0xFFFF)
+    {
+        // movzx eax, ax (3 bytes)
+        vm.executable_code[index++] = 0x0F;
+        vm.executable_code[index++] = 0xB7;
+        vm.executable_code[index++] = 0xC0;
+    }
+    else if (vm.memory_mask != 0xFFFFFFFF)
+    {
+        // and eax, memory_mask (5 bytes)
+        vm.executable_code[index++] = 0x25;
+        vm.executable_code[index++] = (vm.memory_mask >> 0) & 0xFF;
+        vm.executable_code[index++] = (vm.memory_mask >> 8) & 0xFF;
+        vm.executable_code[index++] = (vm.memory_mask >> 16) & 0xFF;
+        vm.executable_code[index++] = (vm.memory_mask >> 24) & 0xFF;
+    }
+}
+
+// pc como aparece no log: 16 bits enquanto o espaço de endereços couber neles
+static uint32_t trace_pc(Machine_x86 &vm, uint32_t pc)
+{
+    return vm.memory_size <= 0x10000 ? (uint16_t)pc : pc;
+}
+
+// jmp rel32 (5 bytes) para um offset absoluto no código
+static void emit_jump(Machine_x86 &vm, uint32_t &index, uint32_t target)
+{
+    int32_t jump_code = target - (index + 5);
+    vm.executable_code[index++] = 0xE9;
+    vm.executable_code[index++] = (jump_code >> 0) & 0xFF;
+    vm.executable_code[index++] = (jump_code >> 8) & 0xFF;
+    vm.executable_code[index++] = (jump_code >> 16) & 0xFF;
+    vm.executable_code[index++] = (jump_code >> 24) & 0xFF;
+}
+
+// Antes de sair de um laço desenrolado: devolve ao array os registradores do
+// laço que ele escreve
+static void emit_loop_spill(Machine_x86 &vm, uint32_t &index)
+{
+    for (size_t i = 0; i < vm.loop_registers.size(); i++)
+    {
+        Loop_register &loop = vm.loop_registers[i];
+        if (loop.written)
+        {
+            // mov dword ptr [rdi + r*4], host (4 bytes)
+            emit_rex(vm, index, loop.host, 0);
+            vm.executable_code[index++] = 0x89;
+            vm.executable_code[index++] = 0x47 | ((loop.host & 7) << 3);
+            vm.executable_code[index++] = loop.r * 4;
+        }
+    }
+}
+
+// Continua a execução em target_pc: salto direto se o bloco já existe, senão
+// mov eax, target_pc + jmp para o despacho indireto (ou para o epílogo, se o
+// alvo está fora do programa e a VM termina). O despacho indireto é provisório:
+// link_exits() troca a saída por um jmp direto quando o alvo for compilado.
+static void emit_goto(Machine_x86 &vm, uint32_t &index, uint32_t target_pc)
+{
+    emit_loop_spill(vm, index);
+    if (target_pc < vm.program_size && vm.dispatch_table[target_pc].native != nullptr)
+    {
+        emit_jump(vm, index, vm.dispatch_table[target_pc].native - vm.executable_code);
+        return;
+    }
+    if (target_pc < vm.program_size)
+    {
+        vm.pending_exits[target_pc].push_back(index);
+    }
+
+    // mov eax, target_pc (5 bytes)
+    vm.executable_code[index++] = 0xB8;
+    vm.executable_code[index++] = (target_pc >> 0) & 0xFF;
+    vm.executable_code[index++] = (target_pc >> 8) & 0xFF;
+    vm.executable_code[index++] = (target_pc >> 16) & 0xFF;
+    vm.executable_code[index++] = (target_pc >> 24) & 0xFF;
+    emit_jump(vm, index, target_pc < vm.program_size ? vm.dispatch : vm.epilogue);
+}
+
+// Liga ao bloco recém-compilado em pc as saídas que esperavam por ele:
+// mov eax, pc; jmp dispatch -> jmp bloco (5 bytes, o resto fica morto)
+static void link_exits(Machine_x86 &vm, uint32_t pc)
+{
+    vector<uint32_t> &sites = vm.pending_exits[pc];
+
+    for (size_t i = 0; i < sites.size(); i++)
+    {
+        uint32_t site = sites[i];
+        unseal_code(vm, site);
+        emit_jump(vm, site, vm.dispatch_table[pc].native - vm.executable_code);
+    }
+    vector<uint32_t>().swap(sites);
+}
+
+// Depois de um decremento: se o contador zerou, sai para o despachante em C++
+// com target_pc
+static void emit_exit_if_zero(Machine_x86 &vm, uint32_t &index, uint32_t target_pc)
+{
+    // jnz rel8 (2 bytes) pulando a saída
+    vm.executable_code[index++] = 0x75;
+    uint32_t skip = index++;
+    emit_loop_spill(vm, index);
+    // mov eax, target_pc (5 bytes)
+    vm.executable_code[index++] = 0xB8;
+    vm.executable_code[index++] = (target_pc >> 0) & 0xFF;
+    vm.executable_code[index++] = (target_pc >> 8) & 0xFF;
+    vm.executable_code[index++] = (target_pc >> 16) & 0xFF;
+    vm.executable_code[index++] = (target_pc >> 24) & 0xFF;
+    // jmp epilogue (5 bytes)
+    emit_jump(vm, index, vm.epilogue);
+    vm.executable_code[skip] = index - (skip + 1);
+}
+
+// Aresta de retorno (salto para trás). Gasta um passo do orçamento, que fica em
+// r10d enquanto o código nativo executa: quando ele acaba, a VM volta ao host
+// com target_pc para continuar depois, então nenhum laço prende a thread. Na
+// camada 1 também conta uma volta do laço em target_pc e, quando o contador de
+// calor zera, sai para o despachante recompilar o laço inteiro.
+static void emit_backedge(Machine_x86 &vm, uint32_t &index, uint32_t target_pc, bool tier1)
+{
+    // sub r10d, 1 (4 bytes)
+    vm.executable_code[index++] = 0x41;
+    vm.executable_code[index++] = 0x83;
+    vm.executable_code[index++] = 0xEA;
+    vm.executable_code[index++] = 0x01;
+    emit_exit_if_zero(vm, index, target_pc);
+
+    if (tier1)
+    {
+        uint32_t disp = (HOTNESS_BASE + target_pc) * 4;
+
+        // sub dword ptr [rsi + disp32], 1 (7 bytes)
+        vm.executable_code[index++] = 0x83;
+        vm.executable_code[index++] = 0xAE;
+        vm.executable_code[index++] = (disp >> 0) & 0xFF;
+        vm.executable_code[index++] = (disp >> 8) & 0xFF;
+        vm.executable_code[index++] = (disp >> 16) & 0xFF;
+        vm.executable_code[index++] = (disp >> 24) & 0xFF;
+        vm.executable_code[index++] = 0x01;
+        emit_exit_if_zero(vm, index, target_pc);
+    }
+}
+
+// jcc rel32 (6 bytes) para um offset absoluto no código
+static void emit_jcc(Machine_x86 &vm, uint32_t &index, uint8_t condition, uint32_t target)
+{
+    int32_t jump_code = target - (index + 6);
+    vm.executable_code[index++] = 0x0F;
+    vm.executable_code[index++] = condition;
+    vm.executable_code[index++] = (jump_code >> 0) & 0xFF;
+    vm.executable_code[index++] = (jump_code >> 8) & 0xFF;
+    vm.executable_code[index++] = (jump_code >> 16) & 0xFF;
+    vm.executable_code[index++] = (jump_code >> 24) & 0xFF;
+}
+
+// Escolhe os registradores PQP mais usados no programa para ficarem em registradores host
+static void allocate_registers(Machine_x86 &vm)
+{
+    uint32_t uses[REGISTERS_NUM] = {0};
+
+    for (uint32_t pc = 0; pc + 1 < vm.program_size; pc += INSTRUCTION_SIZE)
+    {
+        uint8_t opcode = vm.decoded.opcode[pc];
+        uint8_t rx = vm.decoded.rx[pc];
+        uint8_t ry = vm.decoded.ry[pc];
+
+        if (opcode == 0x00 || opcode == 0x0E || opcode == 0x0F)
+        {
+            uses[rx]++;
+        }
+        else if (opcode <= 0x04 || (opcode >= 0x09 && opcode <= 0x0D))
+        {
+            uses[rx]++;
+            uses[ry]++;
+        }
+    }
+
+    for (uint32_t i = 0; i < HOST_REGISTERS_NUM; i++)
+    {
+        uint8_t best = 0;
+        for (uint8_t r = 1; r < REGISTERS_NUM; r++)
+        {
+            if (uses[r] > uses[best])
+            {
+                best = r;
+            }
+        }
+        if (uses[best] == 0)
+        {
+            break;
+        }
+        vm.host_register[best] = host_registers[i];
+        uses[best] = 0;
+    }
+}
+
+// Marca os destinos de todos os saltos do programa, o ponto de entrada e os pcs
+// de retomada, onde a execução também chega sem passar pela instrução anterior
+static void find_jump_targets(Machine_x86 &vm)
+{
+    if (vm.entry_pc < vm.program_size)
+    {
+        vm.dispatch_table[vm.entry_pc].jump_target = true;
+    }
+    for (size_t i = 0; i < vm.resume_entries.size(); i++)
+    {
+        vm.dispatch_table[vm.resume_entries[i]].jump_target = true;
+    }
+    for (uint32_t pc = 0; pc + 3 < vm.program_size; pc += INSTRUCTION_SIZE)
+    {
+        uint8_t opcode = vm.memory[pc];
+
+        if (opcode >= 0x05 && opcode <= 0x08)
+        {
+            int32_t offset = (int16_t)(vm.memory[pc + 2] | (vm.memory[pc + 3] << 8));
+            uint32_t target_pc = pc + INSTRUCTION_SIZE + offset;
+
+            if (target_pc < vm.program_size)
+            {
+                vm.dispatch_table[target_pc].jump_target = true;
+            }
+        }
+    }
+}
+
+// cmp cujas flags o jcc em pc consome, se a única forma de chegar no jcc é vindo
+// desse cmp em linha reta, passando só por outros jcc e por instruções que não
+// escrevem os registradores comparados (nem stores, que podem reescrever o cmp).
+// Nesse caso o jcc pode refazer o cmp com os registradores atuais, que não
+// mudaram desde então.
+static uint32_t fused_compare(Machine_x86 &vm, uint32_t pc)
+{
+    bool written[REGISTERS_NUM] = {false};
+    uint32_t first = pc >= FUSE_DISTANCE * INSTRUCTION_SIZE ? pc - FUSE_DISTANCE * INSTRUCTION_SIZE : 0;
+
+    while (pc >= INSTRUCTION_SIZE && pc > first && !vm.dispatch_table[pc].jump_target)
+    {
+        pc -= INSTRUCTION_SIZE;
+        uint8_t opcode = vm.decoded.opcode[pc];
+        uint8_t rx = vm.decoded.rx[pc];
+
+        if (opcode == 0x04)
+        {
+            return written[rx] || written[vm.decoded.ry[pc]] ? NO_COMPARE : pc;
+        }
+        if (opcode == 0x03 || opcode == 0x05 || opcode > 0x0F)
+        {
+            break;
+        }
+        if (opcode < 0x06 || opcode > 0x08)
+        {
+            written[rx] = true;
+        }
+    }
+    return NO_COMPARE;
+}
+
+// Byte do programa como a análise o viu; depois do fim, o da memória
+static uint8_t analyzed_byte(Machine_x86 &vm, uint32_t address)
+{
+    return address < vm.program_size ? vm.analyzed_code[address] : vm.memory[address];
+}
+
+// Decodifica as instruções em [first, end). O cmp fundido de um jcc depende só
+// das instruções antes dele, já decodificadas.
+static void decode_range(Machine_x86 &vm, uint32_t first, uint32_t end)
+{
+    Decoded_program &code = vm.decoded;
+
+    for (uint32_t pc = first; pc < end; pc++)
+    {
+        uint8_t opcode = analyzed_byte(vm, pc);
+        uint8_t operands = analyzed_byte(vm, pc + 1);
+        int32_t imm = (int16_t)(analyzed_byte(vm, pc + 2) | (analyzed_byte(vm, pc + 3) << 8));
+
+        code.opcode[pc] = opcode;
+        code.rx[pc] = operands >> 4;
+        code.ry[pc] = operands & 0x0F;
+        code.imm[pc] = opcode == 0x0E || opcode == 0x0F ? analyzed_byte(vm, pc + 3) & 0x1F : imm;
+        code.target[pc] = pc + INSTRUCTION_SIZE + imm;
+        code.compare[pc] = opcode >= 0x06 && opcode <= 0x08 ? fused_compare(vm, pc) : NO_COMPARE;
+    }
+}
+
+// Decodifica o programa inteiro, depois de find_jump_targets()
+static void decode_program(Machine_x86 &vm)
+{
+    Decoded_program &code = vm.decoded;
+
+    code.opcode.resize(vm.program_size);
+    code.rx.resize(vm.program_size);
+    code.ry.resize(vm.program_size);
+    code.imm.resize(vm.program_size);
+    code.target.resize(vm.program_size);
+    code.compare.resize(vm.program_size);
+    decode_range(vm, 0, vm.program_size);
+    vm.visited_pcs.assign(vm.program_size, 0);
+    vm.visit_generation = 0;
+}
+
+// Verifica se algum jcc não fundido pode ler as flags do cmp em compare_pc,
+// ou seja, se o cmp precisa guardar os operandos em compare
+static bool flags_observed(Machine_x86 &vm, uint32_t compare_pc)
+{
+    vector<uint32_t> &visited = vm.visited_pcs;
+    vector<uint32_t> &pending = vm.pending_pcs;
+
+    if (++vm.visit_generation == 0)
+    {
+        fill(visited.begin(), visited.end(), 0);
+        vm.visit_generation = 1;
+    }
+    pending.assign(1, compare_pc + INSTRUCTION_SIZE);
+
+    while (!pending.empty())
+    {
+        uint32_t pc = pending.back();
+        pending.pop_back();
+
+        if (pc >= vm.program_size || visited[pc] == vm.visit_generation)
+        {
+            continue;
+        }
+        visited[pc] = vm.visit_generation;
+
+        uint8_t opcode = vm.decoded.opcode[pc];
+        uint32_t target_pc = vm.decoded.target[pc];
+
+        if (opcode == 0x04 || opcode > 0x0F)
+        {
+            continue;
+        }
+        if (opcode >= 0x06 && opcode <= 0x08)
+        {
+            if (vm.decoded.compare[pc] == NO_COMPARE)
+            {
+                return true;
+            }
+            pending.push_back(target_pc);
+        }
+        if (opcode == 0x05)
+        {
+            pending.push_back(target_pc);
+        }
+        else
+        {
+            pending.push_back(pc + INSTRUCTION_SIZE);
+        }
+    }
+    return false;
+}
+
+// Prólogo: salva os callee-saved, carrega os registradores alocados e o orçamento
+// de passos (r10d) e salta para r8.
+// Epílogo: devolve os registradores alocados e o orçamento e retorna eax (o pc).
+static void emit_prologue(Machine_x86 &vm)
+{
+    uint32_t index = PROLOGUE_OFFSET;
+    uint8_t used[REGISTERS_NUM];
+
+    reserve_code(vm, 256);
+    uint8_t used_num = 0;
+
+    for (uint8_t r = 0; r < REGISTERS_NUM; r++)
+    {
+        if (vm.host_register[r] != NO_HOST_REGISTER)
+        {
+            used[used_num++] = r;
+        }
+    }
+
+    for (uint8_t i = 0; i < used_num; i++)
+    {
+        uint8_t host = vm.host_register[used[i]];
+        // push host (1-2 bytes)
+        emit_rex(vm, index, 0, host);
+        vm.executable_code[index++] = 0x50 | (host & 7);
+    }
+    for (uint8_t i = 0; i < used_num; i++)
+    {
+        uint8_t host = vm.host_register[used[i]];
+        // mov host, dword ptr [rdi + r*4] (3-4 bytes)
+        emit_rex(vm, index, host, 0);
+        vm.executable_code[index++] = 0x8B;
+        vm.executable_code[index++] = 0x47 | ((host & 7) << 3);
+        vm.executable_code[index++] = used[i] * 4;
+    }
+    // mov r10d, dword ptr [rsi + BUDGET_SLOT*4] (4 bytes)
+    vm.executable_code[index++] = 0x44;
+    vm.executable_code[index++] = 0x8B;
+    vm.executable_code[index++] = 0x56;
+    vm.executable_code[index++] = BUDGET_SLOT * 4;
+    // jmp r8 (3 bytes)
+    vm.executable_code[index++] = 0x41;
+    vm.executable_code[index++] = 0xFF;
+    vm.executable_code[index++] = 0xE0;
+
+    vm.epilogue = index;
+    // mov dword ptr [rsi + BUDGET_SLOT*4], r10d (4 bytes)
+    vm.executable_code[index++] = 0x44;
+    vm.executable_code[index++] = 0x89;
+    vm.executable_code[index++] = 0x56;
+    vm.executable_code[index++] = BUDGET_SLOT * 4;
+    for (uint8_t i = 0; i < used_num; i++)
+    {
+        uint8_t host = vm.host_register[used[i]];
+        // mov dword ptr [rdi + r*4], host (3-4 bytes)
+        emit_rex(vm, index, host, 0);
+        vm.executable_code[index++] = 0x89;
+        vm.executable_code[index++] = 0x47 | ((host & 7) << 3);
+        vm.executable_code[index++] = used[i] * 4;
+    }
+    for (uint8_t i = used_num; i > 0; i--)
+    {
+        uint8_t host = vm.host_register[used[i - 1]];
+        // pop host (1-2 bytes)
+        emit_rex(vm, index, 0, host);
+        vm.executable_code[index++] = 0x58 | (host & 7);
+    }
+    // ret (1 byte)
+    vm.executable_code[index++] = 0xC3;
+
+    // Despacho indireto (eax = pc): salta para o bloco de pc se ele já foi
+    // compilado, senão sai pelo epílogo devolvendo pc ao despachante em C++
+    vm.dispatch = index;
+    // mov r11, qword ptr [rip + dispatch_table] (7 bytes)
+    vm.executable_code[index++] = 0x4C;
+    vm.executable_code[index++] = 0x8B;
+    vm.executable_code[index++] = 0x1D;
+    uint32_t table_disp = index;
+    index += 4;
+    // lea r9, [rax + rax] (4 bytes): entradas de 16 bytes
+    vm.executable_code[index++] = 0x4C;
+    vm.executable_code[index++] = 0x8D;
+    vm.executable_code[index++] = 0x0C;
+    vm.executable_code[index++] = 0x00;
+    // mov r11, qword ptr [r11 + r9*8] (4 bytes), o native da entrada
+    vm.executable_code[index++] = 0x4F;
+    vm.executable_code[index++] = 0x8B;
+    vm.executable_code[index++] = 0x1C;
+    vm.executable_code[index++] = 0xCB;
+    // test r11, r11 (3 bytes)
+    vm.executable_code[index++] = 0x4D;
+    vm.executable_code[index++] = 0x85;
+    vm.executable_code[index++] = 0xDB;
+    // jz epilogue (6 bytes)
+    emit_jcc(vm, index, 0x84, vm.epilogue);
+    // jmp r11 (3 bytes)
+    vm.executable_code[index++] = 0x41;
+    vm.executable_code[index++] = 0xFF;
+    vm.executable_code[index++] = 0xE3;
+
+    // Endereço da tabela de despacho, lido pelo despacho
+    index = (index + 7) & ~7u;
+    int32_t disp = index - (table_disp + 4);
+    memcpy(vm.executable_code + table_disp, &disp, sizeof(disp));
+    Pc_entry *table = vm.dispatch_table.data();
+    memcpy(vm.executable_code + index, &table, sizeof(table));
+    vm.relocations.push_back(index);
+    index += sizeof(table);
+
+    vm.code_size = index;
+}
+
+// Modo perf. Os eventos na ordem de Perf_event; o L1D conta as leituras que
+// faltaram na cache.
+static const uint32_t perf_types[PERF_EVENTS_NUM] = {
+    PERF_TYPE_SOFTWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+static const uint64_t perf_configs[PERF_EVENTS_NUM] = {
+    PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+
+// O mapa /tmp/perf-<pid>.map é um só por processo, com as VMs de todas as threads
+static mutex perf_map_mutex;
+static FILE *perf_map;
+
+// Abre os contadores na thread atual (só o código em modo usuário), se ainda
+// não estão abertos nela. Os eventos que falham ficam de fora do grupo.
+static void perf_open(Machine_x86 &vm)
+{
+    pid_t thread = syscall(SYS_gettid);
+
+    if (vm.perf_thread == thread)
+    {
+        return;
+    }
+    for (int e = 0; e < PERF_EVENTS_NUM; e++)
+    {
+        if (vm.perf_fds[e] >= 0)
+        {
+            close(vm.perf_fds[e]);
+        }
+    }
+    vm.perf_thread = thread;
+    vm.perf_leader = -1;
+    for (int e = 0; e < PERF_EVENTS_NUM; e++)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_types[e];
+        attr.config = perf_configs[e];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        int leader = vm.perf_leader >= 0 ? vm.perf_fds[vm.perf_leader] : -1;
+        vm.perf_fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        if (vm.perf_fds[e] >= 0 && vm.perf_leader < 0)
+        {
+            vm.perf_leader = e;
+        }
+    }
+}
+
+// Valores atuais do grupo; os eventos indisponíveis ficam em 0
+static void perf_read(Machine_x86 &vm, uint64_t *values)
+{
+    uint64_t buffer[1 + PERF_EVENTS_NUM];
+
+    memset(values, 0, PERF_EVENTS_NUM * sizeof(uint64_t));
+    if (vm.perf_leader < 0 || read(vm.perf_fds[vm.perf_leader], buffer, sizeof(buffer)) < (ssize_t)sizeof(uint64_t))
+    {
+        return;
+    }
+    // Um valor por evento do grupo, na ordem em que entraram
+    uint64_t i = 0;
+    for (int e = 0; e < PERF_EVENTS_NUM; e++)
+    {
+        if (vm.perf_fds[e] >= 0 && i < buffer[0])
+        {
+            values[e] = buffer[1 + i++];
+        }
+    }
+}
+
+// Soma em block o que foi gasto desde before
+static void perf_account(Machine_x86 &vm, Perf_block &block, const uint64_t *before)
+{
+    uint64_t after[PERF_EVENTS_NUM];
+
+    perf_read(vm, after);
+    block.entries++;
+    for (int e = 0; e < PERF_EVENTS_NUM; e++)
+    {
+        block.values[e] += after[e] - before[e];
+    }
+}
+
+// Uma linha "início tamanho nome" do mapa para o código em [start, end)
+static void perf_map_symbol(Machine_x86 &vm, uint32_t start, uint32_t end, const char *name)
+{
+    lock_guard<mutex> lock(perf_map_mutex);
+
+    if (perf_map == nullptr)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+        perf_map = fopen(path, "w");
+        if (perf_map == nullptr)
+        {
+            return;
+        }
+    }
+    fprintf(perf_map, "%llx %x %s\n", (unsigned long long)(uintptr_t)(vm.executable_code + start), end - start, name);
+    // O perf lê o mapa depois; sem buffer, o que foi compilado até um crash fica nele
+    fflush(perf_map);
+}
+
+// Entradas de um bloco recém-compilado: cada uma até a seguinte
+static void perf_map_block(Machine_x86 &vm, const Compiled_block &block)
+{
+    for (size_t i = 0; i < block.entries.size(); i++)
+    {
+        uint32_t end = i + 1 < block.entries.size() ? block.entries[i + 1].second : block.code_end;
+        char name[32];
+        snprintf(name, sizeof(name), "pqp_block_0x%04X", block.entries[i].first);
+        perf_map_symbol(vm, block.entries[i].second, end, name);
+    }
+}
+
+// Todo o código atual, depois de vir do cache em disco ou de um snapshot: o
+// prólogo e, pela tabela de despacho, cada entrada até a seguinte
+static void perf_map_code(Machine_x86 &vm, uint32_t prologue_size)
+{
+    vector<pair<uint32_t, uint32_t>> entries;
+
+    perf_map_symbol(vm, 0, prologue_size, "pqp_dispatch");
+    for (uint32_t pc = 0; pc < vm.program_size; pc++)
+    {
+        if (vm.dispatch_table[pc].native != nullptr)
+        {
+            entries.push_back(make_pair(vm.dispatch_table[pc].native - vm.executable_code, pc));
+        }
+    }
+    sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        uint32_t end = i + 1 < entries.size() ? entries[i + 1].first : vm.code_size;
+        char name[32];
+        snprintf(name, sizeof(name), "pqp_block_0x%04X", entries[i].second);
+        perf_map_symbol(vm, entries[i].first, end, name);
+    }
+}
+
+// Linha de texto de um registro, no formato original do log
+static void print_record(FILE *output, const Trace_record &record)
+{
+    static const char *names[] = {"JG", "JL", "JE"};
+    uint32_t pc = record.pc;
+    uint32_t address = record.a;
+    int rx = record.operands >> 4;
+    int ry = record.operands & 0x0F;
+    int32_t a = record.a;
+    int32_t b = record.b;
+
+    switch (record.opcode)
+    {
+    case 0x00:
+        fprintf(output, "0x%04X->MOV_R%d=0x%08X\n", pc, rx, (uint32_t)a);
+        break;
+    case 0x01:
+        fprintf(output, "0x%04X->MOV_R%d=R%d=0x%08X\n", pc, rx, ry, a);
+        break;
+    case 0x02:
+        fprintf(output, "0x%04X->MOV_R%d=MEM[0x%02X,0x%02X,0x%02X,0x%02X]=[0x%02X,0x%02X,0x%02X,0x%02X]\n",
+                pc, rx, address, address + 1, address + 2, address + 3,
+                b & 0xFF, (b >> 8) & 0xFF, (b >> 16) & 0xFF, (b >> 24) & 0xFF);
+        break;
+    case 0x03:
+        fprintf(output, "0x%04X->MOV_MEM[0x%02X,0x%02X,0x%02X,0x%02X]=R%d=[0x%02X,0x%02X,0x%02X,0x%02X]\n",
+                pc, address, address + 1, address + 2, address + 3, ry,
+                b & 0xFF, (b >> 8) & 0xFF, (b >> 16) & 0xFF, (b >> 24) & 0xFF);
+        break;
+    case 0x04:
+        fprintf(output, "0x%04X->CMP_R%d<=>R%d(G=%d,L=%d,E=%d)\n", pc, rx, ry, a > b, a < b, a == b);
+        break;
+    case 0x05:
+        fprintf(output, "0x%04X->JMP_0x%04X\n", pc, a);
+        break;
+    case 0x06:
+    case 0x07:
+    case 0x08:
+        fprintf(output, "0x%04X->%s_0x%04X\n", pc, names[record.opcode - 0x06], a);
+        break;
+    case 0x09:
+        fprintf(output, "0x%04X->ADD_R%d+=R%d=0x%08X+0x%08X=0x%08X\n", pc, rx, ry, a, b, (int32_t)((uint32_t)a + b));
+        break;
+    case 0x0A:
+        fprintf(output, "0x%04X->SUB_R%d-=R%d=0x%08X-0x%08X=0x%08X\n", pc, rx, ry, a, b, (int32_t)((uint32_t)a - b));
+        break;
+    case 0x0B:
+        fprintf(output, "0x%04X->AND_R%d&=R%d=0x%08X&0x%08X=0x%08X\n", pc, rx, ry, a, b, a & b);
+        break;
+    case 0x0C:
+        fprintf(output, "0x%04X->OR_R%d|=R%d=0x%08X|0x%08X=0x%08X\n", pc, rx, ry, a, b, a | b);
+        break;
+    case 0x0D:
+        fprintf(output, "0x%04X->XOR_R%d^=R%d=0x%08X^0x%08X=0x%08X\n", pc, rx, ry, a, b, a ^ b);
+        break;
+    case 0x0E:
+        fprintf(output, "0x%04X->SAL_R%d<<=%d=0x%08X<<%d=0x%08X\n", pc, rx, b, a, b, (int32_t)((uint32_t)a << b));
+        break;
+    case 0x0F:
+        fprintf(output, "0x%04X->SAR_R%d>>=%d=0x%08X>>%d=0x%08X\n", pc, rx, b, a, b, a >> b);
+        break;
+    }
+}
+
+// Linha de saída e estado final, no formato original do log
+// A linha de contagem só sai com contadores; sem eles o formato pula do EXIT
+// direto para os registradores
+static void print_trailer(FILE *output, uint32_t exit_pc, const Trace_trailer &trailer)
+{
+    fprintf(output, "0x%04X->EXIT\n", exit_pc);
+    if (trailer.counted)
+    {
+        fprintf(output, "[");
+        for (int i = 0; i < 15; i++)
+        {
+            fprintf(output, "%02X:%u,", i, trailer.instruction_counts[i]);
+        }
+        fprintf(output, "0F:%u]\n", trailer.instruction_counts[15]);
+    }
+    fprintf(output, "[");
+    for (size_t i = 0; i < REGISTERS_NUM - 1; ++i)
+    {
+        fprintf(output, "R%u=0x%08X,", (unsigned int)i, trailer.registers[i]);
+    }
+    fprintf(output, "R15=0x%08X]", trailer.registers[15]);
+}
+
+static bool trace_open(Trace_writer &writer, Trace_mode mode, const char *path)
+{
+    writer.mode = mode;
+    writer.output = fopen(path, mode == TRACE_BINARY ? "wb" : "w");
+    writer.used = 0;
+    if (writer.output == nullptr)
+    {
+        return false;
+    }
+    if (mode != TRACE_OFF)
+    {
+        writer.buffer.resize(TRACE_BUFFER_RECORDS);
+    }
+    if (mode == TRACE_BINARY)
+    {
+        uint32_t version = TRACE_VERSION;
+        fwrite(TRACE_MAGIC, 4, 1, writer.output);
+        fwrite(&version, sizeof(version), 1, writer.output);
+    }
+    return true;
+}
+
+// Esvazia o buffer: cópia direta no modo binário, decodificação no modo texto
+static void trace_flush(Trace_writer &writer)
+{
+    if (writer.mode == TRACE_BINARY)
+    {
+        fwrite(writer.buffer.data(), sizeof(Trace_record), writer.used, writer.output);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < writer.used; i++)
+        {
+            print_record(writer.output, writer.buffer[i]);
+        }
+    }
+    writer.used = 0;
+}
+
+static void trace_record(Trace_writer &writer, Machine_x86 &vm, uint32_t pc, int32_t a, int32_t b)
+{
+    Trace_record &record = writer.buffer[writer.used++];
+
+    record.pc = pc;
+    record.opcode = vm.decoded.opcode[pc];
+    record.operands = (vm.decoded.rx[pc] << 4) | vm.decoded.ry[pc];
+    record.reserved = 0;
+    record.a = a;
+    record.b = b;
+    if (writer.used == writer.buffer.size())
+    {
+        trace_flush(writer);
+    }
+}
+
+// Fecha o log com a saída e o estado final da VM
+static void trace_close(Trace_writer &writer, Machine_x86 &vm, uint32_t exit_pc)
+{
+    Trace_trailer trailer;
+
+    trailer.counted = vm.count_instructions;
+    memcpy(trailer.instruction_counts, &vm.instruction_counts[0], sizeof(trailer.instruction_counts));
+    memcpy(trailer.registers, &vm.registers[0], sizeof(trailer.registers));
+    trace_flush(writer);
+    if (writer.mode == TRACE_BINARY)
+    {
+        Trace_record exit_record = {exit_pc, TRACE_EXIT, 0, 0, 0, 0};
+        fwrite(&exit_record, sizeof(exit_record), 1, writer.output);
+        fwrite(&trailer, sizeof(trailer), 1, writer.output);
+    }
+    else
+    {
+        print_trailer(writer.output, exit_pc, trailer);
+    }
+    fclose(writer.output);
+    writer.output = nullptr;
+}
+
+// Decodificador offline: converte um log binário para o formato texto
+static bool decode_trace(const char *input_path, const char *output_path)
+{
+    FILE *input = fopen(input_path, "rb");
+    char magic[4];
+    uint32_t version;
+    Trace_record record;
+    Trace_trailer trailer;
+
+    if (input == nullptr)
+    {
+        return false;
+    }
+    if (fread(magic, sizeof(magic), 1, input) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+        fread(&version, sizeof(version), 1, input) != 1 || version != TRACE_VERSION)
+    {
+        fclose(input);
+        return false;
+    }
+
+    FILE *output = fopen(output_path, "w");
+    bool complete = false;
+
+    while (output != nullptr && fread(&record, sizeof(record), 1, input) == 1)
+    {
+        if (record.opcode == TRACE_EXIT)
+        {
+            complete = fread(&trailer, sizeof(trailer), 1, input) == 1;
+            if (complete)
+            {
+                print_trailer(output, record.pc, trailer);
+            }
+            break;
+        }
+        print_record(output, record);
+    }
+    fclose(input);
+    return output != nullptr && fclose(output) == 0 && complete;
+}
+
+// Estado usado para gerar o log de um bloco antes de executá-lo: os registradores
+// evoluem instrução a instrução e as escritas na memória ficam num overlay
+struct Shadow_state
+{
+    int32_t registers[REGISTERS_NUM];
+    vector<pair<uint32_t, uint8_t>> stores;
+};
+
+static uint8_t shadow_byte(Machine_x86 &vm, Shadow_state &shadow, uint32_t address)
+{
+    for (size_t i = shadow.stores.size(); i > 0; i--)
+    {
+        if (shadow.stores[i - 1].first == address)
+        {
+            return shadow.stores[i - 1].second;
+        }
+    }
+    return vm.memory[address];
+}
+
+// Registradores com valor conhecido na compilação: carregados com mov imediato
+// no próprio bloco, ou calculados só a partir deles. dirty indica que o valor
+// ainda não foi escrito (no registrador host ou no array): a escrita é adiada
+// até alguém ler o registrador ou o código sair do bloco, e some se ele for
+// sobrescrito antes.
+struct Block_constants
+{
+    bool known[REGISTERS_NUM];
+    bool dirty[REGISTERS_NUM];
+    int32_t value[REGISTERS_NUM];
+};
+
+static void set_constant(Block_constants &constants, uint8_t r, int32_t value)
+{
+    constants.known[r] = true;
+    constants.dirty[r] = true;
+    constants.value[r] = value;
+}
+
+// r recebe um valor só conhecido na execução
+static void forget_constant(Block_constants &constants, uint8_t r)
+{
+    constants.known[r] = false;
+    constants.dirty[r] = false;
+}
+
+static void emit_mov_immediate(Machine_x86 &vm, uint32_t &index, uint8_t rx, int32_t i32)
+{
+    if (vm.host_register[rx] != NO_HOST_REGISTER)
+    {
+        // mov hx, i32 (5-6 bytes)
+        emit_rex(vm, index, 0, vm.host_register[rx]);
+        vm.executable_code[index++] = 0xB8 | (vm.host_register[rx] & 7);
+    }
+    else
+    {
+        // mov dword ptr [rdi + rx], i32 (7 bytes)
+        vm.executable_code[index++] = 0xC7;
+        vm.executable_code[index++] = 0x47;
+        vm.executable_code[index++] = rx * 4;
+    }
+    vm.executable_code[index++] = (i32 >> 0) & 0xFF;
+    vm.executable_code[index++] = (i32 >> 8) & 0xFF;
+    vm.executable_code[index++] = (i32 >> 16) & 0xFF;
+    vm.executable_code[index++] = (i32 >> 24) & 0xFF;
+}
+
+// Escreve o valor adiado de r antes de uma leitura no código gerado
+static void materialize_constant(Machine_x86 &vm, uint32_t &index, Block_constants &constants, uint8_t r)
+{
+    if (constants.dirty[r])
+    {
+        emit_mov_immediate(vm, index, r, constants.value[r]);
+        constants.dirty[r] = false;
+    }
+}
+
+// Escreve todos os valores adiados: antes de saltos, saídas e entradas de bloco
+static void flush_constants(Machine_x86 &vm, uint32_t &index, Block_constants &constants)
+{
+    for (uint8_t r = 0; r < REGISTERS_NUM; r++)
+    {
+        materialize_constant(vm, index, constants, r);
+    }
+}
+
+// rx op= ry (add, sub, and, or, xor). Com os dois valores conhecidos a operação
+// é feita na compilação; com só ry conhecido vira op rx, imediato (o mov de ry
+// some se ninguém mais o ler); operações neutras não geram código.
+static void emit_alu_folded(Machine_x86 &vm, uint32_t &index, Block_constants &constants, uint8_t opcode, uint8_t rx, uint8_t ry)
+{
+    // Formas "op r/m32, r32" e o campo reg de "op r/m32, imm" (81 /d e 83 /d)
+    static const uint8_t register_opcodes[] = {0x01, 0x29, 0x21, 0x09, 0x31};
+    static const uint8_t immediate_digits[] = {0, 5, 4, 1, 6};
+    uint8_t op = opcode - 0x09;
+
+    if (constants.known[rx] && constants.known[ry])
+    {
+        uint32_t a = constants.value[rx];
+        uint32_t b = constants.value[ry];
+        uint32_t results[] = {a + b, a - b, a & b, a | b, a ^ b};
+        set_constant(constants, rx, results[op]);
+        return;
+    }
+    if (rx == ry)
+    {
+        // x - x = x ^ x = 0; x & x = x | x = x; x + x fica como está
+        if (opcode == 0x0A || opcode == 0x0D)
+        {
+            set_constant(constants, rx, 0);
+            return;
+        }
+        if (opcode == 0x0B || opcode == 0x0C)
+        {
+            return;
+        }
+    }
+
+    materialize_constant(vm, index, constants, rx);
+    if (!constants.known[ry])
+    {
+        emit_alu(vm, index, register_opcodes[op], rx, ry);
+        forget_constant(constants, rx);
+        return;
+    }
+
+    int32_t immediate = constants.value[ry];
+    if (immediate == (opcode == 0x0B ? -1 : 0))
+    {
+        return;
+    }
+    if (opcode == 0x0B && immediate == 0)
+    {
+        set_constant(constants, rx, 0);
+        return;
+    }
+    if (immediate >= -128 && immediate <= 127)
+    {
+        // op rx, i8 (3-4 bytes)
+        emit_operand(vm, index, 0x83, immediate_digits[op], rx);
+        vm.executable_code[index++] = immediate & 0xFF;
+    }
+    else
+    {
+        // op rx, i32 (6-7 bytes)
+        emit_operand(vm, index, 0x81, immediate_digits[op], rx);
+        vm.executable_code[index++] = (immediate >> 0) & 0xFF;
+        vm.executable_code[index++] = (immediate >> 8) & 0xFF;
+        vm.executable_code[index++] = (immediate >> 16) & 0xFF;
+        vm.executable_code[index++] = (immediate >> 24) & 0xFF;
+    }
+    forget_constant(constants, rx);
+}
+
+// sal/sar rx, shift: feito na compilação se rx é conhecido, nada se shift é 0
+static void emit_shift_folded(Machine_x86 &vm, uint32_t &index, Block_constants &constants, uint8_t opcode, uint8_t rx, uint8_t shift)
+{
+    if (constants.known[rx])
+    {
+        int32_t value = constants.value[rx];
+        set_constant(constants, rx, opcode == 0x0E ? (int32_t)((uint32_t)value << shift) : value >> shift);
+        return;
+    }
+    if (shift == 0)
+    {
+        return;
+    }
+
+    // shl/sar rx, shift (3-4 bytes)
+    emit_operand(vm, index, 0xC1, opcode == 0x0E ? 4 : 7, rx);
+    vm.executable_code[index++] = shift;
+}
+
+// Marca os bytes da instrução em pc como código
+static void mark_code(Machine_x86 &vm, uint32_t pc)
+{
+    memset((uint8_t *)&vm.instruction_counts[code_marks_base(vm)] + pc, 1, INSTRUCTION_SIZE);
+}
+
+// A instrução em pc mudou desde a análise (escrita quando ainda não era vigiada)
+static bool code_changed(Machine_x86 &vm, uint32_t pc)
+{
+    return memcmp(vm.memory + pc, &vm.analyzed_code[pc], min<uint32_t>(INSTRUCTION_SIZE, vm.program_size - pc)) != 0;
+}
+
+// A instrução em pc (que não mudou desde a análise) vai executar: marca os bytes
+// dela, e daqui em diante um store neles invalida na hora. Os bytes depois do fim
+// do programa não são vigiados, então os de uma instrução que passa do fim são
+// lidos agora.
+static void watch_instruction(Machine_x86 &vm, uint32_t pc)
+{
+    if (pc + INSTRUCTION_SIZE > vm.program_size)
+    {
+        decode_range(vm, pc, pc + 1);
+    }
+    mark_code(vm, pc);
+    vm.dispatch_table[pc].watched = true;
+}
+
+// Store que pode atingir o código: o teste das marcas fica num stub frio,
+// emitido depois da última saída do bloco, e volta para o store em back
+struct Code_write_stub
+{
+    uint32_t site;
+    uint32_t back;
+    uint32_t pc;
+    uint8_t host;
+    uint32_t profile_position;
+    Block_constants constants;
+};
+
+// Antes de um store (endereço em eax, valor em host): endereços abaixo de
+// program_size vão para o stub do store, o resto só passa pelo cmp e por um jb
+// não tomado, então stores em dados custam o mesmo de antes
+static void emit_code_write_check(Machine_x86 &vm, uint32_t &index, vector<Code_write_stub> &stubs,
+                                  Block_constants &constants, uint32_t pc, uint8_t host)
+{
+    Code_write_stub stub;
+
+    // cmp eax, program_size (5 bytes)
+    vm.executable_code[index++] = 0x3D;
+    vm.executable_code[index++] = (vm.program_size >> 0) & 0xFF;
+    vm.executable_code[index++] = (vm.program_size >> 8) & 0xFF;
+    vm.executable_code[index++] = (vm.program_size >> 16) & 0xFF;
+    vm.executable_code[index++] = (vm.program_size >> 24) & 0xFF;
+    // jb stub (6 bytes), ligado por emit_code_write_stubs()
+    stub.site = index;
+    emit_jcc(vm, index, 0x82, 0);
+    stub.back = index;
+    stub.pc = pc;
+    stub.host = host;
+    stub.profile_position = vm.profile_opcodes.size();
+    // A saída acontece no meio do bloco: as constantes adiadas vão junto
+    stub.constants = constants;
+    stubs.push_back(stub);
+}
+
+// Stubs dos stores do bloco: se o store muda bytes de código, faz o store e sai
+// para o despachante em C++ com o endereço em SMC_ADDRESS_SLOT, a posição no
+// perfil do bloco em SMC_PROFILE_SLOT (para descontar o resto do bloco, que não
+// executou) e eax = pc + 4. Reescrever o código com os mesmos bytes não sai.
+static void emit_code_write_stubs(Machine_x86 &vm, uint32_t &index, vector<Code_write_stub> &stubs)
+{
+    uint32_t marks_disp = code_marks_base(vm) * 4;
+
+    for (size_t i = 0; i < stubs.size(); i++)
+    {
+        Code_write_stub &stub = stubs[i];
+        uint32_t next_pc = stub.pc + INSTRUCTION_SIZE;
+        uint8_t host = stub.host;
+
+        reserve_code(vm, MAX_INSTRUCTION_CODE);
+        emit_jcc(vm, stub.site, 0x82, index);
+        // cmp dword ptr [rsi + rax + marks_disp], 0 (8 bytes): as marcas dos 4 bytes escritos
+        vm.executable_code[index++] = 0x83;
+        vm.executable_code[index++] = 0xBC;
+        vm.executable_code[index++] = 0x06;
+        vm.executable_code[index++] = (marks_disp >> 0) & 0xFF;
+        vm.executable_code[index++] = (marks_disp >> 8) & 0xFF;
+        vm.executable_code[index++] = (marks_disp >> 16) & 0xFF;
+        vm.executable_code[index++] = (marks_disp >> 24) & 0xFF;
+        vm.executable_code[index++] = 0x00;
+        // je back (6 bytes)
+        emit_jcc(vm, index, 0x84, stub.back);
+        // cmp dword ptr [rdx + rax], host (3-4 bytes)
+        emit_rex(vm, index, host, 0);
+        vm.executable_code[index++] = 0x39;
+        vm.executable_code[index++] = 0x04 | ((host & 7) << 3);
+        vm.executable_code[index++] = 0x02;
+        // je back (6 bytes)
+        emit_jcc(vm, index, 0x84, stub.back);
+        // mov dword ptr [rdx + rax], host (3-4 bytes)
+        emit_rex(vm, index, host, 0);
+        vm.executable_code[index++] = 0x89;
+        vm.executable_code[index++] = 0x04 | ((host & 7) << 3);
+        vm.executable_code[index++] = 0x02;
+
+        flush_constants(vm, index, stub.constants);
+        emit_loop_spill(vm, index);
+        // mov dword ptr [rsi + SMC_ADDRESS_SLOT*4], eax (3 bytes)
+        vm.executable_code[index++] = 0x89;
+        vm.executable_code[index++] = 0x46;
+        vm.executable_code[index++] = SMC_ADDRESS_SLOT * 4;
+        if (vm.count_instructions)
+        {
+            // mov dword ptr [rsi + SMC_PROFILE_SLOT*4], profile_position (7 bytes)
+            vm.executable_code[index++] = 0xC7;
+            vm.executable_code[index++] = 0x46;
+            vm.executable_code[index++] = SMC_PROFILE_SLOT * 4;
+            vm.executable_code[index++] = (stub.profile_position >> 0) & 0xFF;
+            vm.executable_code[index++] = (stub.profile_position >> 8) & 0xFF;
+            vm.executable_code[index++] = (stub.profile_position >> 16) & 0xFF;
+            vm.executable_code[index++] = (stub.profile_position >> 24) & 0xFF;
+        }
+        // mov eax, pc + 4 (5 bytes)
+        vm.executable_code[index++] = 0xB8;
+        vm.executable_code[index++] = (next_pc >> 0) & 0xFF;
+        vm.executable_code[index++] = (next_pc >> 8) & 0xFF;
+        vm.executable_code[index++] = (next_pc >> 16) & 0xFF;
+        vm.executable_code[index++] = (next_pc >> 24) & 0xFF;
+        // jmp epilogue (5 bytes)
+        emit_jump(vm, index, vm.epilogue);
+    }
+}
+
+// Quantas cópias do corpo do laço [head, end) a camada 2 emite. Só laços de um
+// caminho são desenrolados: nenhum salto nem destino de salto no meio, e a
+// última instrução é o único salto, de volta para head. Todas as instruções já
+// executaram, então o log não precisa de nada do laço.
+static uint32_t loop_unroll(Machine_x86 &vm, uint32_t head, uint32_t end, bool trace)
+{
+    uint32_t last = end - INSTRUCTION_SIZE;
+
+    if (end > vm.program_size || end - head < 2 * INSTRUCTION_SIZE)
+    {
+        return 1;
+    }
+    for (uint32_t pc = head; pc < end; pc += INSTRUCTION_SIZE)
+    {
+        uint8_t opcode = vm.decoded.opcode[pc];
+        bool jump = opcode >= 0x05 && opcode <= 0x08;
+
+        if (opcode > 0x0F || jump != (pc == last) || (pc != head && vm.dispatch_table[pc].jump_target) ||
+            (trace && vm.dispatch_table[pc].not_interpreted) || code_changed(vm, pc))
+        {
+            return 1;
+        }
+    }
+    if (vm.decoded.target[last] != head)
+    {
+        return 1;
+    }
+    return max<uint32_t>(1, min<uint32_t>(MAX_UNROLL, UNROLL_INSTRUCTIONS / ((end - head) / INSTRUCTION_SIZE)));
+}
+
+// Entrada do laço desenrolado [head, end): os registradores PQP mais usados nele
+// que moram no array passam para r8d/r11d até a saída, e no empate os que o laço
+// só lê. Esses são carregados uma vez aqui em vez de a cada volta; os escritos
+// voltam ao array só nas saídas (emit_loop_spill()).
+static void emit_loop_entry(Machine_x86 &vm, uint32_t &index, uint32_t head, uint32_t end)
+{
+    uint32_t uses[REGISTERS_NUM] = {0};
+    bool written[REGISTERS_NUM] = {false};
+
+    for (uint32_t pc = head; pc < end; pc += INSTRUCTION_SIZE)
+    {
+        uint8_t opcode = vm.decoded.opcode[pc];
+        uint8_t rx = vm.decoded.rx[pc];
+        uint8_t ry = vm.decoded.ry[pc];
+
+        if (opcode == 0x00 || opcode == 0x0E || opcode == 0x0F)
+        {
+            uses[rx]++;
+        }
+        else if (opcode <= 0x04 || (opcode >= 0x09 && opcode <= 0x0D))
+        {
+            uses[rx]++;
+            uses[ry]++;
+        }
+        if (opcode <= 0x02 || opcode >= 0x09)
+        {
+            written[rx] = true;
+        }
+    }
+    for (uint8_t r = 0; r < REGISTERS_NUM; r++)
+    {
+        uses[r] = vm.host_register[r] != NO_HOST_REGISTER ? 0 : uses[r] * 2 + (uses[r] != 0 && !written[r]);
+    }
+
+    for (uint32_t i = 0; i < LOOP_REGISTERS_NUM; i++)
+    {
+        uint8_t best = 0;
+        for (uint8_t r = 1; r < REGISTERS_NUM; r++)
+        {
+            if (uses[r] > uses[best])
+            {
+                best = r;
+            }
+        }
+        if (uses[best] == 0)
+        {
+            break;
+        }
+        Loop_register loop = {best, loop_host_registers[i], written[best]};
+        vm.loop_registers.push_back(loop);
+        vm.host_register[best] = loop.host;
+        uses[best] = 0;
+
+        // mov host, dword ptr [rdi + r*4] (4 bytes)
+        emit_rex(vm, index, loop.host, 0);
+        vm.executable_code[index++] = 0x8B;
+        vm.executable_code[index++] = 0x47 | ((loop.host & 7) << 3);
+        vm.executable_code[index++] = best * 4;
+    }
+}
+
+// Load ou store de um laço vetorizado: o endereço é a indução r mais 4 se o
+// add/sub de r vem antes no corpo (updated)
+struct Vector_access
+{
+    uint32_t pc;
+    uint8_t r;
+    bool updated;
+    bool store;
+};
+
+// Laço vetorizável [head, end). Cada registrador escrito nele é uma indução
+// (lido antes de escrito na volta e escrito só por um add/sub de um registrador
+// que o laço não escreve) ou um temporário (escrito antes de ser lido, em toda
+// volta). Um bloco vetorial só roda se a volta seguinte também continua, e ela
+// é escalar e refaz os temporários e as flags, então o bloco só precisa dos
+// stores e das induções. O laço termina com cmp do contador (uma indução) com um
+// invariante e jg/jl de volta.
+struct Vector_loop
+{
+    bool written[REGISTERS_NUM];
+    bool induction[REGISTERS_NUM];
+    uint8_t stride[REGISTERS_NUM];
+    bool negative[REGISTERS_NUM];
+    // Induções usadas como endereço (passo 4) e invariantes usados como valor
+    bool address[REGISTERS_NUM];
+    bool broadcast[REGISTERS_NUM];
+    vector<Vector_access> accesses;
+    uint8_t counter;
+    uint8_t bound;
+    // A volta continua enquanto counter > bound (senão, counter < bound)
+    bool greater;
+};
+
+// Valor de r numa lane: temporário ou invariante, nunca indução
+static bool vector_value(Vector_loop &loop, uint8_t r)
+{
+    loop.broadcast[r] |= !loop.written[r];
+    return !loop.induction[r];
+}
+
+// Analisa o laço de um caminho [head, end) (loop_unroll() > 1). Retorna false se
+// ele não tem a forma de Vector_loop.
+static bool vector_loop(Machine_x86 &vm, uint32_t head, uint32_t end, Vector_loop &loop)
+{
+    uint32_t compare = end - 2 * INSTRUCTION_SIZE;
+    uint8_t jump = vm.decoded.opcode[end - INSTRUCTION_SIZE];
+    bool read_first[REGISTERS_NUM] = {false};
+    uint32_t writes[REGISTERS_NUM] = {0};
+    uint32_t update[REGISTERS_NUM] = {0};
+    bool updated[REGISTERS_NUM] = {false};
+
+    if (compare < head || vm.decoded.opcode[compare] != 0x04 || (jump != 0x06 && jump != 0x07))
+    {
+        return false;
+    }
+    for (uint32_t pc = head; pc < compare; pc += INSTRUCTION_SIZE)
+    {
+        uint8_t opcode = vm.decoded.opcode[pc];
+        uint8_t rx = vm.decoded.rx[pc];
+        uint8_t ry = vm.decoded.ry[pc];
+
+        if (opcode == 0x04 || (opcode >= 0x05 && opcode <= 0x08))
+        {
+            return false;
+        }
+        if (opcode == 0x03 || opcode >= 0x09)
+        {
+            read_first[rx] |= writes[rx] == 0;
+        }
+        if ((opcode >= 0x01 && opcode <= 0x03) || (opcode >= 0x09 && opcode <= 0x0D))
+        {
+            read_first[ry] |= writes[ry] == 0;
+        }
+        if (opcode != 0x03)
+        {
+            writes[rx]++;
+            update[rx] = pc;
+        }
+    }
+
+    for (uint8_t r = 0; r < REGISTERS_NUM; r++)
+    {
+        loop.written[r] = writes[r] != 0;
+        loop.induction[r] = writes[r] != 0 && read_first[r];
+        loop.address[r] = false;
+        loop.broadcast[r] = false;
+        if (loop.induction[r])
+        {
+            uint8_t opcode = vm.decoded.opcode[update[r]];
+            loop.stride[r] = vm.decoded.ry[update[r]];
+            loop.negative[r] = opcode == 0x0A;
+            if (writes[r] != 1 || (opcode != 0x09 && opcode != 0x0A) || loop.stride[r] == r)
+            {
+                return false;
+            }
+        }
+    }
+    for (uint8_t r = 0; r < REGISTERS_NUM; r++)
+    {
+        if (loop.induction[r] && loop.written[loop.stride[r]])
+        {
+            return false;
+        }
+    }
+
+    uint8_t cx = vm.decoded.rx[compare];
+    uint8_t cy = vm.decoded.ry[compare];
+    if (loop.induction[cx] && !loop.written[cy])
+    {
+        loop.counter = cx;
+        loop.bound = cy;
+        loop.greater = jump == 0x06;
+    }
+    else if (loop.induction[cy] && !loop.written[cx])
+    {
+        loop.counter = cy;
+        loop.bound = cx;
+        loop.greater = jump == 0x07;
+    }
+    else
+    {
+        return false;
+    }
+
+    bool stored = false;
+    loop.accesses.clear();
+    for (uint32_t pc = head; pc < compare; pc += INSTRUCTION_SIZE)
+    {
+        uint8_t opcode = vm.decoded.opcode[pc];
+        uint8_t rx = vm.decoded.rx[pc];
+        uint8_t ry = vm.decoded.ry[pc];
+        bool valid = true;
+
+        switch (opcode)
+        {
+        case 0x01:
+            valid = vector_value(loop, ry);
+            break;
+        case 0x02:
+        case 0x03:
+        {
+            uint8_t r = opcode == 0x02 ? ry : rx;
+            Vector_access access = {pc, r, updated[r], opcode == 0x03};
+            loop.accesses.push_back(access);
+            loop.address[r] = true;
+            stored |= access.store;
+            valid = loop.induction[r] && (opcode == 0x02 || vector_value(loop, ry));
+            break;
+        }
+        case 0x09:
+        case 0x0A:
+            if (loop.induction[rx] && update[rx] == pc)
+            {
+                updated[rx] = true;
+                break;
+            }
+            // fallthrough
+        case 0x0B:
+        case 0x0C:
+        case 0x0D:
+            valid = vector_value(loop, rx) && vector_value(loop, ry);
+            break;
+        }
+        if (!valid)
+        {
+            return false;
+        }
+    }
+    return stored && loop.accesses.size() <= MAX_VECTOR_ACCESSES;
+}
+
+// Instrução vetorial "opcode reg, rm" do mapa 0F (map 1) ou 0F38 (map 2) com
+// prefixo 66 ou F3, sobre o registrador vetorial rm ou sobre [rdx + rax]
+// (VECTOR_MEMORY). Com AVX2 sai em VEX.256 com source no vvvv (a primeira
+// fonte das operações de três operandos); com SSE2, no formato legado, em que o
+// destino já é a primeira fonte. vmovd (6E) só existe em 128 bits.
+static void emit_vector(Machine_x86 &vm, uint32_t &index, uint8_t prefix, uint8_t map, uint8_t opcode,
+                        uint8_t reg, uint8_t rm, uint8_t source = VECTOR_NO_SOURCE)
+{
+    uint8_t base = rm != VECTOR_MEMORY ? rm : 0;
+
+    if (vm.vector_lanes == 8)
+    {
+        // VEX de 3 bytes: R, X, B e vvvv invertidos, L e pp
+        vm.executable_code[index++] = 0xC4;
+        vm.executable_code[index++] = ((reg & 8) ? 0x00 : 0x80) | 0x40 | ((base & 8) ? 0x00 : 0x20) | map;
+        vm.executable_code[index++] = ((~source & 0x0F) << 3) | (opcode != 0x6E ? 0x04 : 0x00) |
+                                      (prefix == 0x66 ? 0x01 : 0x02);
+    }
+    else
+    {
+        vm.executable_code[index++] = prefix;
+        emit_rex(vm, index, reg, base);
+        vm.executable_code[index++] = 0x0F;
+        if (map == 2)
+        {
+            vm.executable_code[index++] = 0x38;
+        }
+    }
+    vm.executable_code[index++] = opcode;
+    if (rm == VECTOR_MEMORY)
+    {
+        vm.executable_code[index++] = 0x04 | ((reg & 7) << 3);
+        vm.executable_code[index++] = 0x02;
+    }
+    else
+    {
+        vm.executable_code[index++] = 0xC0 | ((reg & 7) << 3) | (rm & 7);
+    }
+}
+
+// Copia eax para todas as lanes do registrador vetorial v
+static void emit_vector_broadcast(Machine_x86 &vm, uint32_t &index, uint8_t v)
+{
+    // movd xmm_v, eax
+    emit_vector(vm, index, 0x66, 1, 0x6E, v, 0);
+    if (vm.vector_lanes == 8)
+    {
+        // vpbroadcastd ymm_v, xmm_v
+        emit_vector(vm, index, 0x66, 2, 0x58, v, v);
+    }
+    else
+    {
+        // pshufd xmm_v, xmm_v, 0
+        emit_vector(vm, index, 0x66, 1, 0x70, v, v);
+        vm.executable_code[index++] = 0x00;
+    }
+}
+
+// eax = endereço do acesso na primeira volta do bloco, já mascarado
+static void emit_vector_address(Machine_x86 &vm, uint32_t &index, const Vector_access &access)
+{
+    // mov eax, r
+    emit_operand(vm, index, 0x8B, 0, access.r);
+    if (access.updated)
+    {
+        // add eax, 4 (3 bytes)
+        vm.executable_code[index++] = 0x83;
+        vm.executable_code[index++] = 0xC0;
+        vm.executable_code[index++] = 0x04;
+    }
+    emit_address_mask(vm, index);
+}
+
+// jcc rel32 para a versão escalar, com o destino ligado no fim do laço vetorial
+static void emit_vector_fallback(Machine_x86 &vm, uint32_t &index, vector<pair<uint32_t, uint8_t>> &fallbacks,
+                                 uint8_t condition)
+{
+    fallbacks.push_back(make_pair(index, condition));
+    emit_jcc(vm, index, condition, index);
+}
+
+// Versão vetorial do laço, emitida na entrada antes do corpo escalar. Na entrada
+// confere uma vez o que não muda entre blocos (passo 4 nos endereços e nenhum
+// store sobrepondo outro acesso dentro de um bloco) e espalha os invariantes
+// pelas lanes; a cada bloco, que as vector_lanes voltas continuam, que há
+// orçamento para elas e que nenhum acesso dá a volta no espaço de endereços nem
+// escreve no programa. Qualquer teste que falha segue para o laço escalar, que
+// faz o resto das voltas; o fim do corpo escalar volta para cá.
+static void emit_vector_loop(Machine_x86 &vm, uint32_t &index, uint32_t head, uint32_t end, const Vector_loop &loop)
+{
+    uint32_t lanes = vm.vector_lanes;
+    uint32_t shift = lanes == 8 ? 3 : 2;
+    vector<pair<uint32_t, uint8_t>> fallbacks;
+    const vector<Vector_access> &accesses = loop.accesses;
+    // jle/jge: o contador passou do limite
+    uint8_t exit_condition = loop.greater ? 0x8E : 0x8D;
+
+    reserve_code(vm, index - vm.code_size + MAX_VECTOR_CODE);
+    for (uint8_t r = 0; r < REGISTERS_NUM; r++)
+    {
+        if (loop.address[r])
+        {
+            // mov eax, stride; cmp eax, +-4 (3 bytes); jne
+            emit_operand(vm, index, 0x8B, 0, loop.stride[r]);
+            vm.executable_code[index++] = 0x83;
+            vm.executable_code[index++] = 0xF8;
+            vm.executable_code[index++] = loop.negative[r] ? 0xFC : 0x04;
+            emit_vector_fallback(vm, index, fallbacks, 0x85);
+        }
+    }
+    // Com i antes de j no corpo e um dos dois store, o bloco muda o resultado só
+    // se 0 < endereço(j) - endereço(i) < 4 * lanes
+    for (size_t i = 0; i < accesses.size(); i++)
+    {
+        for (size_t j = i + 1; j < accesses.size(); j++)
+        {
+            if (!accesses[i].store && !accesses[j].store)
+            {
+                continue;
+            }
+            emit_vector_address(vm, index, accesses[i]);
+            // mov r9d, eax (3 bytes)
+            vm.executable_code[index++] = 0x41;
+            vm.executable_code[index++] = 0x89;
+            vm.executable_code[index++] = 0xC1;
+            emit_vector_address(vm, index, accesses[j]);
+            // sub eax, r9d (3 bytes)
+            vm.executable_code[index++] = 0x44;
+            vm.executable_code[index++] = 0x29;
+            vm.executable_code[index++] = 0xC8;
+            // sub eax, 1; cmp eax, 4 * lanes - 1 (3 bytes cada); jb
+            vm.executable_code[index++] = 0x83;
+            vm.executable_code[index++] = 0xE8;
+            vm.executable_code[index++] = 0x01;
+            vm.executable_code[index++] = 0x83;
+            vm.executable_code[index++] = 0xF8;
+            vm.executable_code[index++] = 4 * lanes - 1;
+            emit_vector_fallback(vm, index, fallbacks, 0x82);
+        }
+    }
+    for (uint8_t r = 0; r < REGISTERS_NUM; r++)
+    {
+        if (loop.broadcast[r])
+        {
+            // mov eax, r
+            emit_operand(vm, index, 0x8B, 0, r);
+            emit_vector_broadcast(vm, index, r);
+        }
+    }
+
+    uint32_t block = index;
+    // cmp r10d, lanes (4 bytes); jbe: o orçamento acaba dentro do bloco
+    vm.executable_code[index++] = 0x41;
+    vm.executable_code[index++] = 0x83;
+    vm.executable_code[index++] = 0xFA;
+    vm.executable_code[index++] = lanes;
+    emit_vector_fallback(vm, index, fallbacks, 0x86);
+
+    // O contador visto pelo cmp vai de counter + passo a counter + lanes * passo,
+    // sem estouro (jo); a sequência é monótona, então bastam as duas pontas
+    // mov r9d, stride
+    emit_operand(vm, index, 0x8B, 9, loop.stride[loop.counter]);
+    if (loop.negative[loop.counter])
+    {
+        // neg r9d (3 bytes); jo
+        vm.executable_code[index++] = 0x41;
+        vm.executable_code[index++] = 0xF7;
+        vm.executable_code[index++] = 0xD9;
+        emit_vector_fallback(vm, index, fallbacks, 0x80);
+    }
+    // mov eax, counter
+    emit_operand(vm, index, 0x8B, 0, loop.counter);
+    for (int i = 0; i < 2; i++)
+    {
+        // add eax, r9d (3 bytes); jo
+        vm.executable_code[index++] = 0x44;
+        vm.executable_code[index++] = 0x01;
+        vm.executable_code[index++] = 0xC8;
+        emit_vector_fallback(vm, index, fallbacks, 0x80);
+        // cmp eax, bound
+        emit_operand(vm, index, 0x3B, 0, loop.bound);
+        emit_vector_fallback(vm, index, fallbacks, exit_condition);
+        if (i == 0)
+        {
+            // imul r9d, r9d, lanes - 1 (4 bytes); jo
+            vm.executable_code[index++] = 0x45;
+            vm.executable_code[index++] = 0x6B;
+            vm.executable_code[index++] = 0xC9;
+            vm.executable_code[index++] = lanes - 1;
+            emit_vector_fallback(vm, index, fallbacks, 0x80);
+        }
+    }
+
+    for (size_t i = 0; i < accesses.size(); i++)
+    {
+        uint32_t last = vm.memory_mask - 4 * (lanes - 1);
+
+        emit_vector_address(vm, index, accesses[i]);
+        // cmp eax, last (5 bytes); ja
+        vm.executable_code[index++] = 0x3D;
+        vm.executable_code[index++] = (last >> 0) & 0xFF;
+        vm.executable_code[index++] = (last >> 8) & 0xFF;
+        vm.executable_code[index++] = (last >> 16) & 0xFF;
+        vm.executable_code[index++] = (last >> 24) & 0xFF;
+        emit_vector_fallback(vm, index, fallbacks, 0x87);
+        if (accesses[i].store)
+        {
+            // cmp eax, program_size (5 bytes); jb
+            vm.executable_code[index++] = 0x3D;
+            vm.executable_code[index++] = (vm.program_size >> 0) & 0xFF;
+            vm.executable_code[index++] = (vm.program_size >> 8) & 0xFF;
+            vm.executable_code[index++] = (vm.program_size >> 16) & 0xFF;
+            vm.executable_code[index++] = (vm.program_size >> 24) & 0xFF;
+            emit_vector_fallback(vm, index, fallbacks, 0x82);
+        }
+    }
+
+    // sub r10d, lanes (4 bytes): um passo por volta, como nas arestas de retorno
+    vm.executable_code[index++] = 0x41;
+    vm.executable_code[index++] = 0x83;
+    vm.executable_code[index++] = 0xEA;
+    vm.executable_code[index++] = lanes;
+    if (vm.count_instructions)
+    {
+        // add dword ptr [rsi + disp32], lanes (7 bytes): entradas do bloco
+        // escalar seguinte, cujo contador emit_block_count() cria em seguida
+        uint32_t disp = vm.instruction_counts.size() * 4;
+        vm.executable_code[index++] = 0x83;
+        vm.executable_code[index++] = 0x86;
+        vm.executable_code[index++] = (disp >> 0) & 0xFF;
+        vm.executable_code[index++] = (disp >> 8) & 0xFF;
+        vm.executable_code[index++] = (disp >> 16) & 0xFF;
+        vm.executable_code[index++] = (disp >> 24) & 0xFF;
+        vm.executable_code[index++] = lanes;
+    }
+
+    size_t next = 0;
+    for (uint32_t pc = head; pc < end - 2 * INSTRUCTION_SIZE; pc += INSTRUCTION_SIZE)
+    {
+        // padd, psub, pand, por, pxor
+        static const uint8_t operations[] = {0xFE, 0xFA, 0xDB, 0xEB, 0xEF};
+        uint8_t opcode = vm.decoded.opcode[pc];
+        uint8_t rx = vm.decoded.rx[pc];
+        uint8_t ry = vm.decoded.ry[pc];
+
+        switch (opcode)
+        {
+        case 0x00: // mov rx, i16
+        {
+            int32_t i32 = vm.decoded.imm[pc];
+            // mov eax, i32 (5 bytes)
+            vm.executable_code[index++] = 0xB8;
+            vm.executable_code[index++] = (i32 >> 0) & 0xFF;
+            vm.executable_code[index++] = (i32 >> 8) & 0xFF;
+            vm.executable_code[index++] = (i32 >> 16) & 0xFF;
+            vm.executable_code[index++] = (i32 >> 24) & 0xFF;
+            emit_vector_broadcast(vm, index, rx);
+            break;
+        }
+        case 0x01: // mov rx, ry
+            if (rx != ry)
+            {
+                // movdqa v_rx, v_ry
+                emit_vector(vm, index, 0x66, 1, 0x6F, rx, ry);
+            }
+            break;
+        case 0x02: // mov rx, [ry]
+            emit_vector_address(vm, index, accesses[next++]);
+            // movdqu v_rx, [rdx + rax]
+            emit_vector(vm, index, 0xF3, 1, 0x6F, rx, VECTOR_MEMORY);
+            break;
+        case 0x03: // mov [rx], ry
+            emit_vector_address(vm, index, accesses[next++]);
+            // movdqu [rdx + rax], v_ry
+            emit_vector(vm, index, 0xF3, 1, 0x7F, ry, VECTOR_MEMORY);
+            break;
+        case 0x09:
+        case 0x0A:
+        case 0x0B:
+        case 0x0C:
+        case 0x0D:
+            if (!loop.induction[rx])
+            {
+                // op v_rx, v_ry
+                emit_vector(vm, index, 0x66, 1, operations[opcode - 0x09], rx, ry, rx);
+            }
+            break;
+        case 0x0E: // sal rx, i5
+        case 0x0F: // sar rx, i5
+            // pslld/psrad v_rx, i5 (o /6 ou /4 vai no campo reg)
+            emit_vector(vm, index, 0x66, 1, 0x72, opcode == 0x0E ? 6 : 4, rx, rx);
+            vm.executable_code[index++] = vm.decoded.imm[pc];
+            break;
+        }
+    }
+
+    for (uint8_t r = 0; r < REGISTERS_NUM; r++)
+    {
+        if (loop.induction[r])
+        {
+            // mov eax, stride; shl eax, log2(lanes) (3 bytes); add/sub r, eax
+            emit_operand(vm, index, 0x8B, 0, loop.stride[r]);
+            vm.executable_code[index++] = 0xC1;
+            vm.executable_code[index++] = 0xE0;
+            vm.executable_code[index++] = shift;
+            emit_operand(vm, index, loop.negative[r] ? 0x29 : 0x01, 0, r);
+        }
+    }
+    emit_jump(vm, index, block);
+
+    for (size_t i = 0; i < fallbacks.size(); i++)
+    {
+        uint32_t site = fallbacks[i].first;
+        emit_jcc(vm, site, fallbacks[i].second, index);
+    }
+    if (lanes == 8)
+    {
+        // vzeroupper (3 bytes): sem custo de transição no código SSE do host
+        vm.executable_code[index++] = 0xC5;
+        vm.executable_code[index++] = 0xF8;
+        vm.executable_code[index++] = 0x77;
+    }
+}
+
+// Compila o bloco básico que começa em pc: as instruções seguintes até o próximo
+// salto, opcode desconhecido ou bloco já compilado, emitidas contíguas no fim do
+// cache de código. Retorna false se não havia nada para compilar (opcode
+// desconhecido em pc).
+//
+// Com region_end, recompila a região [pc, region_end) de um laço quente (camada
+// 2): tudo contíguo, sem saída depois de cada jcc, sem contadores de volta, e
+// com os saltos internos diretos. Instruções que ainda não foram executadas
+// ficam de fora (o log delas sai quando o interpretador as executar). Um laço de
+// um caminho só é desenrolado (loop_unroll()): as cópias do meio seguem direto
+// para a seguinte quando o salto de volta é tomado e só a última salta.
+static bool compile_block(Machine_x86 &vm, uint32_t pc, Trace_writer &writer, uint32_t region_end = 0)
+{
+    Shadow_state shadow;
+    Block_constants constants;
+    Compiled_block block;
+    vector<Code_write_stub> stubs;
+    Vector_loop vectorized;
+    uint32_t start = pc;
+    uint32_t index = vm.code_size;
+    bool block_end = false;
+    uint32_t unroll = region_end != 0 ? loop_unroll(vm, start, region_end, writer.mode != TRACE_OFF) : 1;
+    uint32_t copy = 0;
+    // Início do corpo do laço desenrolado, depois das cargas da entrada
+    uint32_t body = index;
+
+    if (pc >= vm.program_size || vm.memory[pc] > 0x0F)
+    {
+        return false;
+    }
+
+    memcpy(shadow.registers, &vm.registers[0], sizeof(shadow.registers));
+    memset(&constants, 0, sizeof(constants));
+    if (region_end != 0)
+    {
+        // O código antigo continua válido para quem já salta direto para ele
+        for (uint32_t i = start; i < region_end; i++)
+        {
+            vm.dispatch_table[i].native = nullptr;
+        }
+    }
+    vm.dispatch_table[start].native = vm.executable_code + index;
+    block.start_pc = start;
+    block.code_start = index;
+    block.entries.push_back(make_pair(start, index));
+    if (region_end == 0)
+    {
+        link_exits(vm, start);
+        emit_block_count(vm, index);
+    }
+    // Na região, um bloco novo (com o seu contador e a sua entrada na tabela de despacho)
+    // começa depois de cada salto e em cada destino de salto
+    bool block_start = true;
+
+    // Uma instrução escrita depois da análise fica para o despachante, que
+    // atualiza a análise antes de executá-la
+    while (pc < vm.program_size && vm.memory[pc] <= 0x0F && (pc == start || !code_changed(vm, pc)) &&
+           (region_end != 0 ? pc < region_end : !block_end && (pc == start || vm.dispatch_table[pc].native == nullptr)))
+    {
+        uint8_t opcode = vm.decoded.opcode[pc];
+        // Instruções já executadas antes (em outro bloco) não voltam ao log
+        bool trace = writer.mode != TRACE_OFF && vm.dispatch_table[pc].not_interpreted;
+
+        if (region_end != 0)
+        {
+            reserve_code(vm, MAX_INSTRUCTION_CODE);
+            if (trace)
+            {
+                if (!block_end)
+                {
+                    flush_constants(vm, index, constants);
+                    emit_goto(vm, index, pc);
+                }
+                block_end = true;
+                block_start = true;
+                pc += INSTRUCTION_SIZE;
+                continue;
+            }
+            if (copy > 0 && pc == start)
+            {
+                // Próxima cópia do corpo: ninguém entra aqui de fora, então as
+                // constantes continuam valendo
+                emit_block_count(vm, index);
+            }
+            else if (block_start || vm.dispatch_table[pc].jump_target)
+            {
+                // Quem entra aqui vindo de outro lugar não conhece as constantes
+                flush_constants(vm, index, constants);
+                memset(&constants, 0, sizeof(constants));
+                // Invalidar a região sobrescreve 5 bytes em cada entrada com um
+                // jmp, então entradas seguidas ficam a pelo menos 5 bytes
+                while (index < block.entries.back().second + 5 && pc != start)
+                {
+                    // nop (1 byte)
+                    vm.executable_code[index++] = 0x90;
+                }
+                if (pc != start)
+                {
+                    block.entries.push_back(make_pair(pc, index));
+                }
+                vm.dispatch_table[pc].native = vm.executable_code + index;
+                link_exits(vm, pc);
+                if (unroll > 1)
+                {
+                    emit_loop_entry(vm, index, start, region_end);
+                    body = index;
+                }
+                // A região ou um laço dentro dela que dá para vetorizar: a versão
+                // vetorial vem antes do corpo, e o salto de volta cai nela
+                uint32_t loop_end = pc == start ? region_end : vm.dispatch_table[pc].loop_end;
+                if (loop_end != 0 && loop_end <= region_end &&
+                    loop_unroll(vm, pc, loop_end, writer.mode != TRACE_OFF) > 1 &&
+                    vector_loop(vm, pc, loop_end, vectorized))
+                {
+                    emit_vector_loop(vm, index, pc, loop_end, vectorized);
+                }
+                emit_block_count(vm, index);
+            }
+        }
+        block_end = false;
+        block_start = false;
+        vm.dispatch_table[pc].not_interpreted = false;
+        vm.compiled_instructions += copy == 0;
+        watch_instruction(vm, pc);
+        reserve_code(vm, MAX_INSTRUCTION_CODE);
+
+        switch (opcode)
+        {
+        case 0x00: // mov rx, i16
+        {
+            uint8_t rx = vm.decoded.rx[pc];
+            int32_t i32 = vm.decoded.imm[pc];
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, i32, 0);
+            }
+            shadow.registers[rx] = i32;
+
+            // Sem código por enquanto: o mov sai quando rx for lido
+            set_constant(constants, rx, i32);
+            profile_opcode(vm, opcode);
+            break;
+        }
+
+        case 0x01: // mov rx, ry
+        {
+            uint8_t rx = vm.decoded.rx[pc];
+            uint8_t ry = vm.decoded.ry[pc];
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, shadow.registers[ry], 0);
+            }
+            shadow.registers[rx] = shadow.registers[ry];
+            profile_opcode(vm, opcode);
+
+            if (rx == ry)
+            {
+                break;
+            }
+            if (constants.known[ry])
+            {
+                set_constant(constants, rx, constants.value[ry]);
+                break;
+            }
+            forget_constant(constants, rx);
+
+            if (vm.host_register[rx] != NO_HOST_REGISTER)
+            {
+                // mov hx, ry
+                emit_operand(vm, index, 0x8B, vm.host_register[rx], ry);
+            }
+            else if (vm.host_register[ry] != NO_HOST_REGISTER)
+            {
+                // mov dword ptr [rdi + rx], hy
+                emit_operand(vm, index, 0x89, vm.host_register[ry], rx);
+            }
+            else
+            {
+                // mov eax, dword ptr [rdi + ry]
+                emit_operand(vm, index, 0x8B, 0, ry);
+                // mov dword ptr [rdi + rx], eax
+                emit_operand(vm, index, 0x89, 0, rx);
+            }
+            break;
+        }
+
+        case 0x02: // mov rx, [ry]
+        {
+            uint8_t rx = vm.decoded.rx[pc];
+            uint8_t ry = vm.decoded.ry[pc];
+            uint32_t address = shadow.registers[ry] & vm.memory_mask;
+            uint8_t temp1 = shadow_byte(vm, shadow, address);
+            uint8_t temp2 = shadow_byte(vm, shadow, address + 1);
+            uint8_t temp3 = shadow_byte(vm, shadow, address + 2);
+            uint8_t temp4 = shadow_byte(vm, shadow, address + 3);
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, address, temp1 | (temp2 << 8) | (temp3 << 16) | ((uint32_t)temp4 << 24));
+            }
+            shadow.registers[rx] = temp1 | (temp2 << 8) | (temp3 << 16) | ((uint32_t)temp4 << 24);
+
+            uint8_t host = vm.host_register[rx] != NO_HOST_REGISTER ? vm.host_register[rx] : 0;
+
+            materialize_constant(vm, index, constants, ry);
+            forget_constant(constants, rx);
+            // mov eax, ry
+            emit_operand(vm, index, 0x8B, 0, ry);
+            emit_address_mask(vm, index);
+            // mov host, dword ptr [rdx + rax] (3-4 bytes)
+            emit_rex(vm, index, host, 0);
+            vm.executable_code[index++] = 0x8B;
+            vm.executable_code[index++] = 0x04 | ((host & 7) << 3);
+            vm.executable_code[index++] = 0x02;
+            if (host == 0)
+            {
+                // mov dword ptr [rdi + rx], eax
+                emit_operand(vm, index, 0x89, 0, rx);
+            }
+            profile_opcode(vm, opcode);
+            break;
+        }
+
+        case 0x03: // mov [rx], ry
+        {
+            uint8_t rx = vm.decoded.rx[pc];
+            uint8_t ry = vm.decoded.ry[pc];
+            uint32_t address = shadow.registers[rx] & vm.memory_mask;
+            int32_t value = shadow.registers[ry];
+
+            uint8_t temp1 = (value & 0x000000FF);
+            uint8_t temp2 = (value & 0x0000FF00) >> 8;
+            uint8_t temp3 = (value & 0x00FF0000) >> 16;
+            uint8_t temp4 = (value & 0xFF000000) >> 24;
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, address, value);
+            }
+            shadow.stores.push_back(make_pair(address, temp1));
+            shadow.stores.push_back(make_pair(address + 1, temp2));
+            shadow.stores.push_back(make_pair(address + 2, temp3));
+            shadow.stores.push_back(make_pair(address + 3, temp4));
+
+            // r9d guarda o valor quando ry não está em registrador (rcx aponta para compare)
+            uint8_t host = vm.host_register[ry] != NO_HOST_REGISTER ? vm.host_register[ry] : 9;
+
+            materialize_constant(vm, index, constants, rx);
+            materialize_constant(vm, index, constants, ry);
+            // mov eax, rx
+            emit_operand(vm, index, 0x8B, 0, rx);
+            emit_address_mask(vm, index);
+            if (host == 9)
+            {
+                // mov r9d, dword ptr [rdi + ry] (4 bytes)
+                emit_operand(vm, index, 0x8B, 9, ry);
+            }
+            profile_opcode(vm, opcode);
+            // Endereço constante fora do programa: nunca é código
+            if (!constants.known[rx] || ((uint32_t)constants.value[rx] & vm.memory_mask) < vm.program_size)
+            {
+                emit_code_write_check(vm, index, stubs, constants, pc, host);
+            }
+            // mov dword ptr [rdx + rax], host (3-4 bytes)
+            emit_rex(vm, index, host, 0);
+            vm.executable_code[index++] = 0x89;
+            vm.executable_code[index++] = 0x04 | ((host & 7) << 3);
+            vm.executable_code[index++] = 0x02;
+            break;
+        }
+
+        case 0x04: // cmp rx, ry
+        {
+            uint8_t rx = vm.decoded.rx[pc];
+            uint8_t ry = vm.decoded.ry[pc];
+            int32_t val_rx = shadow.registers[rx];
+            int32_t val_ry = shadow.registers[ry];
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, val_rx, val_ry);
+            }
+
+            profile_opcode(vm, opcode);
+
+            // Se todos os jcc que leem estas flags refazem o cmp, não há o que
+            // guardar; senão só os operandos, e o jcc compara de novo
+            if (flags_observed(vm, pc))
+            {
+                materialize_constant(vm, index, constants, rx);
+                materialize_constant(vm, index, constants, ry);
+                // mov eax, rx
+                emit_operand(vm, index, 0x8B, 0, rx);
+                // mov dword ptr [rcx], eax (2 bytes)
+                vm.executable_code[index++] = 0x89;
+                vm.executable_code[index++] = 0x01;
+                // mov eax, ry
+                emit_operand(vm, index, 0x8B, 0, ry);
+                // mov dword ptr [rcx + 4], eax (3 bytes)
+                vm.executable_code[index++] = 0x89;
+                vm.executable_code[index++] = 0x41;
+                vm.executable_code[index++] = 0x04;
+            }
+            break;
+        }
+
+        case 0x05: // jmp i16
+        {
+            uint32_t target_pc = vm.decoded.target[pc];
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, trace_pc(vm, target_pc), 0);
+            }
+
+            profile_opcode(vm, opcode);
+            flush_constants(vm, index, constants);
+            if (target_pc <= pc)
+            {
+                vm.dispatch_table[target_pc].loop_end = max(vm.dispatch_table[target_pc].loop_end, pc + INSTRUCTION_SIZE);
+                emit_backedge(vm, index, target_pc, region_end == 0);
+            }
+            if (unroll == 1)
+            {
+                emit_goto(vm, index, target_pc);
+            }
+            else if (copy + 1 == unroll)
+            {
+                // jmp body (5 bytes); as cópias do meio seguem para a próxima
+                emit_jump(vm, index, body);
+            }
+            block_end = true;
+            block_start = true;
+            break;
+        }
+
+        case 0x06: // jg i16
+        case 0x07: // jl i16
+        case 0x08: // je i16
+        {
+            // jg, jl, je (segundo byte de jcc rel32)
+            static const uint8_t conditions[] = {0x8F, 0x8C, 0x84};
+            // jle, jge, jne (jcc rel8 com a condição invertida)
+            static const uint8_t inverted[] = {0x7E, 0x7D, 0x75};
+            // jg, jl, je (jcc rel8)
+            static const uint8_t taken[] = {0x7F, 0x7C, 0x74};
+
+            uint32_t target_pc = vm.decoded.target[pc];
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, trace_pc(vm, target_pc), 0);
+            }
+
+            uint32_t compare_pc = vm.decoded.compare[pc];
+
+            profile_opcode(vm, opcode);
+            flush_constants(vm, index, constants);
+            if (compare_pc != NO_COMPARE)
+            {
+                // cmp + jcc: refaz a comparação com os registradores
+                emit_compare(vm, index, vm.decoded.rx[compare_pc], vm.decoded.ry[compare_pc]);
+            }
+            else
+            {
+                // mov eax, dword ptr [rcx] (2 bytes)
+                vm.executable_code[index++] = 0x8B;
+                vm.executable_code[index++] = 0x01;
+                // cmp eax, dword ptr [rcx + 4] (3 bytes)
+                vm.executable_code[index++] = 0x3B;
+                vm.executable_code[index++] = 0x41;
+                vm.executable_code[index++] = 0x04;
+            }
+
+            bool backedge = target_pc <= pc;
+            if (backedge)
+            {
+                vm.dispatch_table[target_pc].loop_end = max(vm.dispatch_table[target_pc].loop_end, pc + INSTRUCTION_SIZE);
+            }
+
+            if (unroll > 1 && copy + 1 < unroll)
+            {
+                // Cópia do meio do laço desenrolado: jcc rel8 (2 bytes) pulando a
+                // saída para a próxima instrução, e a volta segue na próxima cópia
+                vm.executable_code[index++] = taken[opcode - 0x06];
+                uint32_t skip = index++;
+                emit_goto(vm, index, pc + INSTRUCTION_SIZE);
+                vm.executable_code[skip] = index - (skip + 1);
+                emit_backedge(vm, index, target_pc, false);
+                block_start = true;
+                break;
+            }
+            if (!backedge && target_pc < vm.program_size && vm.dispatch_table[target_pc].native != nullptr)
+            {
+                // jcc rel32 (6 bytes) direto para o bloco do alvo
+                emit_jcc(vm, index, conditions[opcode - 0x06], vm.dispatch_table[target_pc].native - vm.executable_code);
+            }
+            else
+            {
+                // jncc rel8 (2 bytes) pulando a saída para o alvo
+                vm.executable_code[index++] = inverted[opcode - 0x06];
+                uint32_t skip = index++;
+                if (backedge)
+                {
+                    emit_backedge(vm, index, target_pc, region_end == 0);
+                }
+                if (unroll > 1)
+                {
+                    // jmp body (5 bytes)
+                    emit_jump(vm, index, body);
+                }
+                else
+                {
+                    emit_goto(vm, index, target_pc);
+                }
+                vm.executable_code[skip] = index - (skip + 1);
+            }
+            // Na região, o caminho não tomado segue direto para a próxima instrução
+            if (region_end == 0 || pc + INSTRUCTION_SIZE >= region_end)
+            {
+                emit_goto(vm, index, pc + INSTRUCTION_SIZE);
+                block_end = true;
+            }
+            block_start = true;
+            break;
+        }
+
+        case 0x09: // add rx, ry
+        {
+            uint8_t rx = vm.decoded.rx[pc];
+            uint8_t ry = vm.decoded.ry[pc];
+            int32_t temp_rx = shadow.registers[rx];
+            int32_t temp = (uint32_t)shadow.registers[rx] + shadow.registers[ry];
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, temp_rx, shadow.registers[ry]);
+            }
+            shadow.registers[rx] = temp;
+
+            emit_alu_folded(vm, index, constants, opcode, rx, ry);
+            profile_opcode(vm, opcode);
+            break;
+        }
+
+        case 0x0A: // sub rx, ry
+        {
+            uint8_t rx = vm.decoded.rx[pc];
+            uint8_t ry = vm.decoded.ry[pc];
+            int32_t temp_rx = shadow.registers[rx];
+            int32_t temp = (uint32_t)shadow.registers[rx] - shadow.registers[ry];
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, temp_rx, shadow.registers[ry]);
+            }
+            shadow.registers[rx] = temp;
+
+            emit_alu_folded(vm, index, constants, opcode, rx, ry);
+            profile_opcode(vm, opcode);
+            break;
+        }
+
+        case 0x0B: // and rx, ry
+        {
+            uint8_t rx = vm.decoded.rx[pc];
+            uint8_t ry = vm.decoded.ry[pc];
+            int32_t temp_rx = shadow.registers[rx];
+            int32_t temp = shadow.registers[rx] & shadow.registers[ry];
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, temp_rx, shadow.registers[ry]);
+            }
+            shadow.registers[rx] = temp;
+
+            emit_alu_folded(vm, index, constants, opcode, rx, ry);
+            profile_opcode(vm, opcode);
+            break;
+        }
+
+        case 0x0C: // or rx, ry
+        {
+            uint8_t rx = vm.decoded.rx[pc];
+            uint8_t ry = vm.decoded.ry[pc];
+            int32_t temp_rx = shadow.registers[rx];
+            int32_t temp = shadow.registers[rx] | shadow.registers[ry];
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, temp_rx, shadow.registers[ry]);
+            }
+            shadow.registers[rx] = temp;
+
+            emit_alu_folded(vm, index, constants, opcode, rx, ry);
+            profile_opcode(vm, opcode);
+            break;
+        }
+
+        case 0x0D: // xor rx, ry
+        {
+            uint8_t rx = vm.decoded.rx[pc];
+            uint8_t ry = vm.decoded.ry[pc];
+            int32_t temp_rx = shadow.registers[rx];
+            int32_t temp = shadow.registers[rx] ^ shadow.registers[ry];
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, temp_rx, shadow.registers[ry]);
+            }
+            shadow.registers[rx] = temp;
+
+            emit_alu_folded(vm, index, constants, opcode, rx, ry);
+            profile_opcode(vm, opcode);
+            break;
+        }
+
+        case 0x0E: // sal rx, i5
+        {
+            uint8_t rx = vm.decoded.rx[pc];
+            uint8_t shift_left = vm.decoded.imm[pc];
+            int32_t temp_rx = shadow.registers[rx];
+            int32_t temp = (uint32_t)shadow.registers[rx] << shift_left;
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, temp_rx, shift_left);
+            }
+            shadow.registers[rx] = temp;
+
+            emit_shift_folded(vm, index, constants, opcode, rx, shift_left);
+            profile_opcode(vm, opcode);
+            break;
+        }
+
+        case 0x0F: // sar rx, i5
+        {
+            uint8_t rx = vm.decoded.rx[pc];
+            uint8_t shift_right = vm.decoded.imm[pc];
+            int32_t signed_val = shadow.registers[rx];
+            int32_t temp_rx = shadow.registers[rx];
+            signed_val >>= shift_right;
+
+            if (trace)
+            {
+                trace_record(writer, vm, pc, temp_rx, shift_right);
+            }
+            shadow.registers[rx] = signed_val;
+
+            emit_shift_folded(vm, index, constants, opcode, rx, shift_right);
+            profile_opcode(vm, opcode);
+            break;
+        }
+        }
+
+        pc += INSTRUCTION_SIZE;
+        if (pc == region_end && copy + 1 < unroll)
+        {
+            copy++;
+            pc = start;
+        }
+    }
+
+    if (!block_end)
+    {
+        // Fim do programa, opcode desconhecido ou bloco já compilado em pc
+        reserve_code(vm, MAX_INSTRUCTION_CODE);
+        flush_constants(vm, index, constants);
+        emit_goto(vm, index, pc);
+    }
+    emit_code_write_stubs(vm, index, stubs);
+    vm.code_size = index;
+    for (size_t i = 0; i < vm.loop_registers.size(); i++)
+    {
+        vm.host_register[vm.loop_registers[i].r] = NO_HOST_REGISTER;
+    }
+    vm.loop_registers.clear();
+
+    block.end_pc = pc;
+    block.code_end = index;
+    if (vm.perf)
+    {
+        perf_map_block(vm, block);
+    }
+    vm.blocks.push_back(block);
+    return true;
+}
+
+// Fim do prólogo (o ponteiro da tabela é o último dado dele): daí em diante só há blocos
+static uint32_t prologue_end(Machine_x86 &vm)
+{
+    return vm.relocations.empty() ? 0 : vm.relocations[0] + (uint32_t)sizeof(uint8_t **);
+}
+
+// Descarta todo o código compilado e refaz a análise do programa: depois de
+// mudar um cmp, um salto ou o fim do programa, qualquer bloco pode ter sido
+// compilado com uma análise errada
+static void flush_code(Machine_x86 &vm)
+{
+    // As entradas dos blocos descartados continuam contadas
+    expand_profile(vm);
+    vm.profile_blocks.clear();
+    vm.profile_opcodes.clear();
+    vm.instruction_counts.resize(HOTNESS_BASE);
+    vm.instruction_counts.resize(HOTNESS_BASE + vm.program_size, TIER1_THRESHOLD);
+    vm.instruction_counts.resize(HOTNESS_BASE + vm.program_size + vm.code_marks, 0);
+
+    for (uint32_t pc = 0; pc < vm.program_size; pc++)
+    {
+        Pc_entry &entry = vm.dispatch_table[pc];
+        entry.native = nullptr;
+        entry.loop_end = 0;
+        entry.jump_target = false;
+        entry.optimized = false;
+        entry.watched = false;
+    }
+    vm.pending_exits.assign(vm.program_size, vector<uint32_t>());
+    find_jump_targets(vm);
+    decode_program(vm);
+    vm.blocks.clear();
+    vm.cached_blocks = false;
+    vm.code_size = prologue_end(vm);
+}
+
+// Invalida os blocos com instruções em [address, end): cada entrada deles vira
+// um jmp para uma saída nova (mov eax, pc; jmp dispatch), então quem ainda salta
+// direto para o bloco (saídas ligadas, blocos antigos de laços otimizados) volta
+// ao despachante. A saída é religada quando pc for compilado de novo.
+static void invalidate_blocks(Machine_x86 &vm, uint32_t address, uint32_t end)
+{
+    unseal_code(vm, vm.code_size);
+    for (size_t b = 0; b < vm.blocks.size();)
+    {
+        Compiled_block &block = vm.blocks[b];
+
+        if (address >= block.end_pc || end <= block.start_pc)
+        {
+            b++;
+            continue;
+        }
+
+        for (size_t i = 0; i < block.entries.size(); i++)
+        {
+            uint32_t pc = block.entries[i].first;
+            Pc_entry &entry = vm.dispatch_table[pc];
+            if (entry.native == vm.executable_code + block.entries[i].second)
+            {
+                entry.native = nullptr;
+                vm.instruction_counts[HOTNESS_BASE + pc] = TIER1_THRESHOLD;
+                entry.optimized = false;
+            }
+        }
+        // Saídas ainda não ligadas de dentro do bloco não podem mais ser religadas
+        for (uint32_t pc = 0; pc < vm.program_size; pc++)
+        {
+            vector<uint32_t> &sites = vm.pending_exits[pc];
+            for (size_t i = sites.size(); i > 0; i--)
+            {
+                if (sites[i - 1] >= block.code_start && sites[i - 1] < block.code_end)
+                {
+                    sites.erase(sites.begin() + (i - 1));
+                }
+            }
+        }
+        unseal_code(vm, block.code_start);
+        for (size_t i = 0; i < block.entries.size(); i++)
+        {
+            uint32_t index = vm.code_size;
+            reserve_code(vm, MAX_INSTRUCTION_CODE);
+            emit_goto(vm, index, block.entries[i].first);
+            uint32_t head = block.entries[i].second;
+            emit_jump(vm, head, vm.code_size);
+            vm.code_size = index;
+        }
+
+        vm.blocks.erase(vm.blocks.begin() + b);
+    }
+    seal_code(vm);
+}
+
+// Um store mudou (ou pode ter mudado) os bytes do programa a partir de address
+static void invalidate_code(Machine_x86 &vm, uint32_t address)
+{
+    uint32_t end = min<uint32_t>(address + INSTRUCTION_SIZE, vm.program_size);
+    uint32_t first = address >= 3 ? address - 3 : 0;
+
+    if (memcmp(vm.memory + address, &vm.analyzed_code[address], end - address) == 0)
+    {
+        return;
+    }
+    vm.code_modified = true;
+
+    // Instruções que cobrem os bytes escritos: mudar um cmp, um salto ou um
+    // opcode inválido muda os destinos de salto e os cmp fundidos
+    bool structural = vm.cached_blocks;
+    for (uint32_t pc = first; pc < end; pc++)
+    {
+        uint8_t before = vm.analyzed_code[pc];
+        uint8_t after = vm.memory[pc];
+        if ((before >= 0x04 && before <= 0x08) || before > 0x0F ||
+            (after >= 0x04 && after <= 0x08) || after > 0x0F)
+        {
+            structural = true;
+        }
+    }
+    memcpy(&vm.analyzed_code[address], vm.memory + address, end - address);
+
+    if (structural)
+    {
+        flush_code(vm);
+        return;
+    }
+    decode_range(vm, first, end);
+    for (uint32_t pc = first; pc < end; pc++)
+    {
+        vm.dispatch_table[pc].watched = false;
+    }
+    invalidate_blocks(vm, address, end);
+}
+
+// Primeira execução interpretada da instrução em pc: se ela foi escrita antes de
+// ser vigiada, a análise e a decodificação são refeitas antes
+static void check_instruction(Machine_x86 &vm, uint32_t pc)
+{
+    if (code_changed(vm, pc))
+    {
+        invalidate_code(vm, pc);
+    }
+    watch_instruction(vm, pc);
+}
+
+// Camada 0: interpreta o bloco básico em pc, até o primeiro salto, com código
+// encadeado (um goto indireto por instrução) sobre o programa decodificado.
+// Um cmp guarda os operandos em compare como o código gerado, então um cmp
+// interpretado pode ser consumido por um jcc compilado e vice-versa.
+// Retorna o pc seguinte.
+static uint32_t interpret_block(Machine_x86 &vm, uint32_t pc, Trace_writer &writer)
+{
+    static void *const handlers[OPCODES_NUM] = {
+        &&mov_i16, &&mov_reg, &&load, &&store, &&compare, &&jmp, &&jg, &&jl,
+        &&je, &&add, &&sub, &&and_reg, &&or_reg, &&xor_reg, &&sal, &&sar};
+    int32_t *registers = &vm.registers[0];
+    const Decoded_program &code = vm.decoded;
+    Pc_entry *entry;
+    uint8_t opcode;
+    uint32_t compare_pc;
+    bool trace;
+    int32_t a;
+    int32_t b;
+
+// Próxima instrução: confere na primeira execução, conta, decide se vai para o
+// log e salta para o tratador
+#define DISPATCH()                                                      \
+    if (pc >= vm.program_size || vm.memory[pc] > 0x0F)                  \
+    {                                                                   \
+        return pc;                                                      \
+    }                                                                   \
+    entry = &vm.dispatch_table[pc];                                     \
+    if (!entry->watched)                                                \
+    {                                                                   \
+        check_instruction(vm, pc);                                      \
+    }                                                                   \
+    opcode = code.opcode[pc];                                           \
+    vm.instruction_counts[opcode] += vm.count_instructions;             \
+    trace = writer.mode != TRACE_OFF && entry->not_interpreted;         \
+    entry->not_interpreted = false;                                     \
+    goto *handlers[opcode]
+
+    DISPATCH();
+
+mov_i16:
+    if (trace)
+    {
+        trace_record(writer, vm, pc, code.imm[pc], 0);
+    }
+    registers[code.rx[pc]] = code.imm[pc];
+    pc += INSTRUCTION_SIZE;
+    DISPATCH();
+
+mov_reg:
+    if (trace)
+    {
+        trace_record(writer, vm, pc, registers[code.ry[pc]], 0);
+    }
+    registers[code.rx[pc]] = registers[code.ry[pc]];
+    pc += INSTRUCTION_SIZE;
+    DISPATCH();
+
+load:
+{
+    uint32_t address = registers[code.ry[pc]] & vm.memory_mask;
+    int32_t value;
+    memcpy(&value, vm.memory + address, sizeof(value));
+    if (trace)
+    {
+        trace_record(writer, vm, pc, address, value);
+    }
+    registers[code.rx[pc]] = value;
+    pc += INSTRUCTION_SIZE;
+    DISPATCH();
+}
+
+store:
+{
+    uint32_t address = registers[code.rx[pc]] & vm.memory_mask;
+    if (trace)
+    {
+        trace_record(writer, vm, pc, address, registers[code.ry[pc]]);
+    }
+    memcpy(vm.memory + address, &registers[code.ry[pc]], sizeof(int32_t));
+    if (address < vm.program_size && code_marks_at(vm, address) != 0)
+    {
+        // As instruções seguintes são decodificadas de novo se mudaram
+        invalidate_code(vm, address);
+    }
+    pc += INSTRUCTION_SIZE;
+    DISPATCH();
+}
+
+compare:
+    if (trace)
+    {
+        trace_record(writer, vm, pc, registers[code.rx[pc]], registers[code.ry[pc]]);
+    }
+    vm.compare[0] = registers[code.rx[pc]];
+    vm.compare[1] = registers[code.ry[pc]];
+    pc += INSTRUCTION_SIZE;
+    DISPATCH();
+
+jmp:
+    if (trace)
+    {
+        trace_record(writer, vm, pc, trace_pc(vm, code.target[pc]), 0);
+    }
+    return code.target[pc];
+
+jg:
+jl:
+je:
+    if (trace)
+    {
+        trace_record(writer, vm, pc, trace_pc(vm, code.target[pc]), 0);
+    }
+    compare_pc = code.compare[pc];
+    a = compare_pc != NO_COMPARE ? registers[code.rx[compare_pc]] : vm.compare[0];
+    b = compare_pc != NO_COMPARE ? registers[code.ry[compare_pc]] : vm.compare[1];
+    if (opcode == 0x06 ? a > b : opcode == 0x07 ? a < b : a == b)
+    {
+        return code.target[pc];
+    }
+    return pc + INSTRUCTION_SIZE;
+
+add:
+    if (trace)
+    {
+        trace_record(writer, vm, pc, registers[code.rx[pc]], registers[code.ry[pc]]);
+    }
+    registers[code.rx[pc]] = (uint32_t)registers[code.rx[pc]] + registers[code.ry[pc]];
+    pc += INSTRUCTION_SIZE;
+    DISPATCH();
+
+sub:
+    if (trace)
+    {
+        trace_record(writer, vm, pc, registers[code.rx[pc]], registers[code.ry[pc]]);
+    }
+    registers[code.rx[pc]] = (uint32_t)registers[code.rx[pc]] - registers[code.ry[pc]];
+    pc += INSTRUCTION_SIZE;
+    DISPATCH();
+
+and_reg:
+    if (trace)
+    {
+        trace_record(writer, vm, pc, registers[code.rx[pc]], registers[code.ry[pc]]);
+    }
+    registers[code.rx[pc]] &= registers[code.ry[pc]];
+    pc += INSTRUCTION_SIZE;
+    DISPATCH();
+
+or_reg:
+    if (trace)
+    {
+        trace_record(writer, vm, pc, registers[code.rx[pc]], registers[code.ry[pc]]);
+    }
+    registers[code.rx[pc]] |= registers[code.ry[pc]];
+    pc += INSTRUCTION_SIZE;
+    DISPATCH();
+
+xor_reg:
+    if (trace)
+    {
+        trace_record(writer, vm, pc, registers[code.rx[pc]], registers[code.ry[pc]]);
+    }
+    registers[code.rx[pc]] ^= registers[code.ry[pc]];
+    pc += INSTRUCTION_SIZE;
+    DISPATCH();
+
+sal:
+    if (trace)
+    {
+        trace_record(writer, vm, pc, registers[code.rx[pc]], code.imm[pc]);
+    }
+    registers[code.rx[pc]] = (uint32_t)registers[code.rx[pc]] << code.imm[pc];
+    pc += INSTRUCTION_SIZE;
+    DISPATCH();
+
+sar:
+    if (trace)
+    {
+        trace_record(writer, vm, pc, registers[code.rx[pc]], code.imm[pc]);
+    }
+    registers[code.rx[pc]] >>= code.imm[pc];
+    pc += INSTRUCTION_SIZE;
+    DISPATCH();
+
+#undef DISPATCH
+}
+
+// Formato texto: bytes em hexadecimal separados por espaços (ex.: input.txt)
+static uint32_t load_text(Machine_x86 &vm, FILE *input)
+{
+    uint32_t pos = 0;
+    uint16_t hex_value;
+    while (fscanf(input, "%hx", &hex_value) == 1 && pos < vm.memory_size)
+    {
+        vm.memory[pos++] = (uint8_t)hex_value;
+    }
+    return pos;
+}
+
+// Formato binário: mapeia o código e os dados direto na memória da VM com
+// MAP_PRIVATE, então só as páginas que o programa escrever são copiadas
+static bool load_image(Machine_x86 &vm, int fd, const Image_header &header, uint32_t &size)
+{
+    struct stat info;
+    uint64_t image_size = (uint64_t)header.code_size + header.data_size;
+
+    if (header.version != IMAGE_VERSION || header.reserved[0] != 0 || header.reserved[1] != 0 ||
+        fstat(fd, &info) != 0 || header.image_offset + image_size > (uint64_t)info.st_size)
+    {
+        return false;
+    }
+    if (image_size > vm.memory_size)
+    {
+        image_size = vm.memory_size;
+    }
+    size = (uint32_t)image_size;
+    // A entrada tem de ser uma instrução da imagem (0 numa imagem vazia)
+    if (header.entry_pc % INSTRUCTION_SIZE != 0 || (header.entry_pc >= size && header.entry_pc != 0))
+    {
+        return false;
+    }
+
+    if (header.image_offset % IMAGE_ALIGN == 0)
+    {
+        uint64_t mapped = (image_size + IMAGE_ALIGN - 1) & ~(uint64_t)(IMAGE_ALIGN - 1);
+        if (size == 0 ||
+            mmap(vm.memory, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, header.image_offset) != MAP_FAILED)
+        {
+            // O que vier depois da imagem no arquivo não pode aparecer na memória
+            memset(vm.memory + size, 0, mapped - size);
+            return true;
+        }
+    }
+    return pread(fd, vm.memory, size, header.image_offset) == (ssize_t)size;
+}
+
+// Carrega uma imagem binária (reconhecida pelo cabeçalho) ou o formato texto
+static bool load_program(Machine_x86 &vm, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    Image_header header;
+    uint32_t size = 0;
+    bool loaded;
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) == 0)
+    {
+        loaded = load_image(vm, fd, header, size);
+        if (loaded)
+        {
+            vm.entry_pc = header.entry_pc;
+        }
+        close(fd);
+    }
+    else
+    {
+        FILE *input = fdopen(fd, "r");
+        size = load_text(vm, input);
+        loaded = true;
+        fclose(input);
+    }
+
+    vm.program_size = size;
+    // Um store no último byte do programa lê 3 marcas além dele
+    vm.code_marks = (size + 3 + 3) / 4;
+    Pc_entry not_compiled = {nullptr, 0, true, false, false, false};
+    vm.dispatch_table.assign(size, not_compiled);
+    vm.pending_exits.assign(size, vector<uint32_t>());
+    vm.instruction_counts.assign(HOTNESS_BASE, 0);
+    vm.instruction_counts[SMC_ADDRESS_SLOT] = NO_SMC;
+    vm.instruction_counts.resize(HOTNESS_BASE + size, TIER1_THRESHOLD);
+    vm.instruction_counts.resize(HOTNESS_BASE + size + vm.code_marks, 0);
+    vm.profile_blocks.clear();
+    vm.profile_opcodes.clear();
+    vm.pc = vm.entry_pc;
+    return loaded;
+}
+
+// Grava o programa carregado como imagem binária (tudo como seção de código)
+static bool write_image(Machine_x86 &vm, const char *path)
+{
+    FILE *image = fopen(path, "wb");
+    Image_header header;
+    static const uint8_t padding[IMAGE_ALIGN] = {0};
+
+    if (image == nullptr)
+    {
+        return false;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.entry_pc = vm.entry_pc;
+    header.code_size = vm.program_size;
+    header.image_offset = IMAGE_ALIGN;
+
+    bool written = fwrite(&header, sizeof(header), 1, image) == 1 &&
+                   fwrite(padding, IMAGE_ALIGN - sizeof(header), 1, image) == 1 &&
+                   fwrite(vm.memory, 1, vm.program_size, image) == vm.program_size;
+    return fclose(image) == 0 && written;
+}
+
+// FNV-1a de 64 bits
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// Tudo que muda o código gerado: o programa, o tamanho da memória (máscara dos
+// endereços), os contadores e o próprio compilador
+static uint64_t code_cache_key(Machine_x86 &vm)
+{
+    static const char compiler[] = "simple_jit_pqp " __DATE__ " " __TIME__;
+    uint32_t version = CODE_CACHE_VERSION;
+    uint64_t hash = 0xCBF29CE484222325ull;
+
+    hash = hash_bytes(hash, compiler, sizeof(compiler));
+    hash = hash_bytes(hash, &version, sizeof(version));
+    hash = hash_bytes(hash, &vm.memory_mask, sizeof(vm.memory_mask));
+    hash = hash_bytes(hash, &vm.entry_pc, sizeof(vm.entry_pc));
+    hash = hash_bytes(hash, &vm.program_size, sizeof(vm.program_size));
+    hash = hash_bytes(hash, &vm.count_instructions, sizeof(vm.count_instructions));
+    // O código dos laços vetorizados depende da CPU
+    hash = hash_bytes(hash, &vm.vector_lanes, sizeof(vm.vector_lanes));
+    return hash_bytes(hash, vm.memory, vm.program_size);
+}
+
+// Mapeia o código salvo por uma execução anterior no início do cache de código
+// e aplica as relocações. Retorna false (sem mudar nada) se o arquivo não
+// existe ou é de outro programa.
+static bool load_code_cache(Machine_x86 &vm, const char *path, uint64_t key)
+{
+    int fd = open(path, O_RDONLY);
+    Code_cache_header header;
+    struct stat info;
+
+    if (fd < 0)
+    {
+        return false;
+    }
+    // Um arquivo truncado daria SIGBUS ao ler o código mapeado além do fim
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, CODE_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CODE_CACHE_VERSION || header.key != key ||
+        header.program_size != vm.program_size || header.code_marks_num != vm.code_marks ||
+        header.code_size > CODE_CACHE_SIZE ||
+        header.code_offset % CODE_CACHE_ALIGN != 0 || fstat(fd, &info) != 0 ||
+        (uint64_t)header.code_offset + header.code_size > (uint64_t)info.st_size)
+    {
+        close(fd);
+        return false;
+    }
+
+    vector<uint32_t> relocations(header.relocations_num);
+    vector<uint32_t> offsets(header.program_size);
+    vector<Cached_loop> loops(header.program_size);
+    vector<uint32_t> profile_blocks(header.profile_blocks_num);
+    vector<uint8_t> profile_opcodes(header.profile_opcodes_num);
+    vector<pair<uint32_t, uint32_t>> exits(header.exits_num);
+    vector<uint32_t> code_marks(header.code_marks_num);
+    size_t relocations_bytes = relocations.size() * sizeof(uint32_t);
+    size_t offsets_bytes = offsets.size() * sizeof(uint32_t);
+    size_t loops_bytes = loops.size() * sizeof(Cached_loop);
+    size_t blocks_bytes = profile_blocks.size() * sizeof(uint32_t);
+    size_t exits_bytes = exits.size() * sizeof(exits[0]);
+    size_t marks_bytes = code_marks.size() * sizeof(uint32_t);
+    off_t loops_offset = sizeof(header) + relocations_bytes + offsets_bytes;
+    off_t tables_offset = loops_offset + loops_bytes;
+    off_t exits_offset = tables_offset + blocks_bytes + profile_opcodes.size();
+    uint32_t mapped = (header.code_size + CODE_CACHE_ALIGN - 1) & ~(CODE_CACHE_ALIGN - 1);
+
+    if (pread(fd, relocations.data(), relocations_bytes, sizeof(header)) != (ssize_t)relocations_bytes ||
+        pread(fd, offsets.data(), offsets_bytes, sizeof(header) + relocations_bytes) != (ssize_t)offsets_bytes ||
+        pread(fd, loops.data(), loops_bytes, loops_offset) != (ssize_t)loops_bytes ||
+        pread(fd, profile_blocks.data(), blocks_bytes, tables_offset) != (ssize_t)blocks_bytes ||
+        pread(fd, profile_opcodes.data(), profile_opcodes.size(), tables_offset + blocks_bytes) !=
+            (ssize_t)profile_opcodes.size() ||
+        pread(fd, exits.data(), exits_bytes, exits_offset) != (ssize_t)exits_bytes ||
+        pread(fd, code_marks.data(), marks_bytes, exits_offset + exits_bytes) != (ssize_t)marks_bytes ||
+        mmap(vm.executable_code, mapped, PROT_READ | PROT_WRITE | (vm.write_xor_execute ? 0 : PROT_EXEC),
+             MAP_PRIVATE | MAP_FIXED, fd, header.code_offset) == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    Pc_entry *table = vm.dispatch_table.data();
+    for (size_t i = 0; i < relocations.size(); i++)
+    {
+        memcpy(vm.executable_code + relocations[i], &table, sizeof(table));
+    }
+    for (uint32_t pc = 0; pc < vm.program_size; pc++)
+    {
+        Pc_entry &entry = vm.dispatch_table[pc];
+        entry.native = offsets[pc] != 0 ? vm.executable_code + offsets[pc] : nullptr;
+        entry.loop_end = loops[pc].loop_end;
+        entry.optimized = loops[pc].optimized != 0;
+        // Como logo depois de compilar: o laço vira região após TIER2_THRESHOLD voltas
+        if (entry.native != nullptr)
+        {
+            vm.instruction_counts[HOTNESS_BASE + pc] = TIER2_THRESHOLD;
+        }
+    }
+    for (size_t i = 0; i < exits.size(); i++)
+    {
+        if (exits[i].second < vm.program_size)
+        {
+            vm.pending_exits[exits[i].second].push_back(exits[i].first);
+        }
+    }
+    vm.relocations = relocations;
+    // O código gerado incrementa os contadores de bloco pelo deslocamento, que
+    // depende só do tamanho do programa
+    vm.profile_blocks = profile_blocks;
+    vm.profile_opcodes = profile_opcodes;
+    vm.instruction_counts.resize(block_counters_base(vm) + profile_blocks.size(), 0);
+    copy(code_marks.begin(), code_marks.end(), vm.instruction_counts.begin() + code_marks_base(vm));
+    vm.cached_blocks = true;
+    vm.code_size = header.code_size;
+    vm.code_committed = mapped;
+    // As relocações já foram aplicadas, então no W^X o código vira RX
+    vm.code_unsealed = 0;
+    seal_code(vm);
+    vm.epilogue = header.epilogue;
+    vm.dispatch = header.dispatch;
+    return true;
+}
+
+// Grava o código compilado até agora. O arquivo é escrito ao lado e renomeado,
+// então execuções concorrentes nunca veem um cache pela metade. O nome
+// temporário leva a thread, não só o processo: no modo lote as threads podem
+// gravar o mesmo programa ao mesmo tempo.
+static bool save_code_cache(Machine_x86 &vm, const char *path, uint64_t key)
+{
+    string temp_path = string(path) + "." + to_string(getpid()) + "." + to_string(syscall(SYS_gettid));
+    Code_cache_header header;
+    static const uint8_t padding[CODE_CACHE_ALIGN] = {0};
+    vector<uint32_t> offsets(vm.program_size, 0);
+    vector<Cached_loop> loops(vm.program_size);
+    vector<pair<uint32_t, uint32_t>> exits;
+
+    FILE *cache = fopen(temp_path.c_str(), "wb");
+    if (cache == nullptr)
+    {
+        return false;
+    }
+
+    for (uint32_t pc = 0; pc < vm.program_size; pc++)
+    {
+        if (vm.dispatch_table[pc].native != nullptr)
+        {
+            offsets[pc] = vm.dispatch_table[pc].native - vm.executable_code;
+        }
+        loops[pc].loop_end = vm.dispatch_table[pc].loop_end;
+        loops[pc].optimized = vm.dispatch_table[pc].optimized;
+        for (size_t i = 0; i < vm.pending_exits[pc].size(); i++)
+        {
+            exits.push_back(make_pair(vm.pending_exits[pc][i], pc));
+        }
+    }
+
+    size_t tables_size = sizeof(header) + (vm.relocations.size() + offsets.size() + vm.profile_blocks.size()) * sizeof(uint32_t) +
+                         loops.size() * sizeof(Cached_loop) + vm.profile_opcodes.size() + exits.size() * sizeof(exits[0]) +
+                         vm.code_marks * sizeof(uint32_t);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CODE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = CODE_CACHE_VERSION;
+    header.key = key;
+    header.program_size = vm.program_size;
+    header.code_size = vm.code_size;
+    header.code_offset = (tables_size + CODE_CACHE_ALIGN - 1) & ~(size_t)(CODE_CACHE_ALIGN - 1);
+    header.epilogue = vm.epilogue;
+    header.dispatch = vm.dispatch;
+    header.relocations_num = vm.relocations.size();
+    header.profile_blocks_num = vm.profile_blocks.size();
+    header.profile_opcodes_num = vm.profile_opcodes.size();
+    header.exits_num = exits.size();
+    header.code_marks_num = vm.code_marks;
+
+    bool written = fwrite(&header, sizeof(header), 1, cache) == 1 &&
+                   fwrite(vm.relocations.data(), sizeof(uint32_t), vm.relocations.size(), cache) == vm.relocations.size() &&
+                   fwrite(offsets.data(), sizeof(uint32_t), offsets.size(), cache) == offsets.size() &&
+                   fwrite(loops.data(), sizeof(Cached_loop), loops.size(), cache) == loops.size() &&
+                   fwrite(vm.profile_blocks.data(), sizeof(uint32_t), vm.profile_blocks.size(), cache) == vm.profile_blocks.size() &&
+                   fwrite(vm.profile_opcodes.data(), 1, vm.profile_opcodes.size(), cache) == vm.profile_opcodes.size() &&
+                   fwrite(exits.data(), sizeof(exits[0]), exits.size(), cache) == exits.size() &&
+                   fwrite(&vm.instruction_counts[code_marks_base(vm)], sizeof(uint32_t), vm.code_marks, cache) == vm.code_marks &&
+                   fwrite(padding, 1, header.code_offset - tables_size, cache) == header.code_offset - tables_size &&
+                   fwrite(vm.executable_code, 1, vm.code_size, cache) == vm.code_size;
+
+    if (fclose(cache) != 0 || !written || rename(temp_path.c_str(), path) != 0)
+    {
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Estado completo de uma VM, para iniciar outras a partir dele. Os campos têm
+// os nomes dos de Machine_x86 (copy_state() copia nos dois sentidos); os
+// ponteiros para o cache de código viram offsets, como no cache em disco.
+struct Vm_snapshot
+{
+    uint64_t memory_size;
+    bool count_instructions;
+    // Memória até RESET_MEMSET_LIMIT: cópia restaurada com memcpy. Acima: memfd
+    // só com as páginas não zeradas, mapeado MAP_PRIVATE na VM restaurada, que
+    // copia uma página só quando a escreve.
+    vector<uint8_t> memory;
+    int memory_fd;
+    vector<uint8_t> code;
+    vector<uint32_t> native_offsets;
+
+    vector<int32_t> registers;
+    uint32_t program_size;
+    uint32_t entry_pc;
+    int32_t compare[2];
+    vector<uint32_t> instruction_counts;
+    uint32_t code_marks;
+    vector<uint32_t> profile_blocks;
+    vector<uint8_t> profile_opcodes;
+    vector<Pc_entry> dispatch_table;
+    Decoded_program decoded;
+    vector<uint8_t> analyzed_code;
+    vector<Compiled_block> blocks;
+    bool code_modified;
+    bool cached_blocks;
+    uint32_t compiled_instructions;
+    uint8_t host_register[REGISTERS_NUM];
+    uint32_t epilogue;
+    uint32_t dispatch;
+    vector<vector<uint32_t>> pending_exits;
+    vector<uint32_t> relocations;
+    uint32_t pc;
+    bool prepared;
+    vector<uint32_t> resume_entries;
+    string cache_path;
+    uint64_t cache_key;
+    uint32_t cached_size;
+    uint64_t compile_ns;
+    uint64_t run_ns;
+    uint64_t run_cycles;
+};
+
+// Tudo menos a memória, o código e os ponteiros nativos da tabela de despacho,
+// que dependem dos endereços da VM
+template <typename To, typename From>
+static void copy_state(To &to, const From &from)
+{
+    to.registers = from.registers;
+    to.program_size = from.program_size;
+    to.entry_pc = from.entry_pc;
+    memcpy(to.compare, from.compare, sizeof(to.compare));
+    to.instruction_counts = from.instruction_counts;
+    to.code_marks = from.code_marks;
+    to.profile_blocks = from.profile_blocks;
+    to.profile_opcodes = from.profile_opcodes;
+    to.dispatch_table = from.dispatch_table;
+    to.decoded = from.decoded;
+    to.analyzed_code = from.analyzed_code;
+    to.blocks = from.blocks;
+    to.code_modified = from.code_modified;
+    to.cached_blocks = from.cached_blocks;
+    to.compiled_instructions = from.compiled_instructions;
+    memcpy(to.host_register, from.host_register, sizeof(to.host_register));
+    to.epilogue = from.epilogue;
+    to.dispatch = from.dispatch;
+    to.pending_exits = from.pending_exits;
+    to.relocations = from.relocations;
+    to.pc = from.pc;
+    to.prepared = from.prepared;
+    to.resume_entries = from.resume_entries;
+    to.cache_path = from.cache_path;
+    to.cache_key = from.cache_key;
+    to.cached_size = from.cached_size;
+    to.compile_ns = from.compile_ns;
+    to.run_ns = from.run_ns;
+    to.run_cycles = from.run_cycles;
+}
+
+// Grava a memória num memfd esparso: páginas zeradas (a maior parte de uma
+// memória grande, nunca tocada) não são escritas e continuam buracos
+static bool snapshot_memory(Machine_x86 &vm, Vm_snapshot &snapshot)
+{
+    static const uint8_t zero_page[CODE_PAGE_SIZE] = {0};
+    uint64_t size = vm.memory_size + MEMORY_GUARD;
+
+    snapshot.memory_fd = memfd_create("pqp-snapshot", MFD_CLOEXEC);
+    if (snapshot.memory_fd < 0 || ftruncate(snapshot.memory_fd, size) != 0)
+    {
+        return false;
+    }
+    for (uint64_t offset = 0; offset < size;)
+    {
+        if (memcmp(vm.memory + offset, zero_page, CODE_PAGE_SIZE) == 0)
+        {
+            offset += CODE_PAGE_SIZE;
+            continue;
+        }
+
+        // Páginas não zeradas seguidas vão num pwrite só
+        uint64_t end = offset + CODE_PAGE_SIZE;
+        while (end < size && memcmp(vm.memory + end, zero_page, CODE_PAGE_SIZE) != 0)
+        {
+            end += CODE_PAGE_SIZE;
+        }
+        for (uint64_t written = offset; written < end;)
+        {
+            ssize_t bytes = pwrite(snapshot.memory_fd, vm.memory + written, end - written, written);
+            if (bytes <= 0)
+            {
+                return false;
+            }
+            written += bytes;
+        }
+        offset = end;
+    }
+    return true;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+Machine_x86 *pqp_create(const Vm_options &options)
+{
+    Machine_x86 *vm = new Machine_x86(options.memory_bits);
+
+    if (vm->memory == nullptr || vm->executable_code == nullptr)
+    {
+        delete vm;
+        return nullptr;
+    }
+    vm->trace_mode = options.trace_mode;
+    vm->count_instructions = options.count_instructions;
+    vm->write_xor_execute = options.write_xor_execute;
+    vm->cache_dir = options.cache_dir != nullptr ? options.cache_dir : "";
+    vm->perf = options.perf;
+    return vm;
+}
+
+void pqp_destroy(Machine_x86 *vm)
+{
+    delete vm;
+}
+
+bool pqp_reset(Machine_x86 *vm)
+{
+    return vm->reset();
+}
+
+// Carregar outro programa numa VM já usada a reinicia antes
+bool pqp_load(Machine_x86 *vm, const char *path)
+{
+    if (vm->memory == nullptr || ((vm->program_size != 0 || vm->prepared) && !vm->reset()))
+    {
+        return false;
+    }
+    return load_program(*vm, path);
+}
+
+bool pqp_open_output(Machine_x86 *vm, const char *path)
+{
+    return trace_open(vm->trace, vm->trace_mode, path);
+}
+
+bool pqp_compile(Machine_x86 *vm)
+{
+    if (vm->prepared)
+    {
+        return true;
+    }
+
+    vm->analyzed_code.assign(vm->memory, vm->memory + vm->program_size);
+    find_jump_targets(*vm);
+    decode_program(*vm);
+    allocate_registers(*vm);
+
+    // O log é gerado ao compilar, então código do cache só serve sem log
+    if (!vm->cache_dir.empty())
+    {
+        vm->cache_key = code_cache_key(*vm);
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.pqpc", (unsigned long long)vm->cache_key);
+        vm->cache_path = vm->cache_dir + name;
+        if (vm->trace.mode == TRACE_OFF && load_code_cache(*vm, vm->cache_path.c_str(), vm->cache_key))
+        {
+            vm->cached_size = vm->code_size;
+            if (vm->perf)
+            {
+                perf_map_code(*vm, prologue_end(*vm));
+            }
+        }
+    }
+    if (vm->cached_size == 0)
+    {
+        unseal_code(*vm, vm->code_size);
+        emit_prologue(*vm);
+        seal_code(*vm);
+        if (vm->perf)
+        {
+            perf_map_symbol(*vm, 0, vm->code_size, "pqp_dispatch");
+        }
+    }
+    vm->prepared = true;
+    return true;
+}
+
+Run_status pqp_run(Machine_x86 *vm_pointer, uint64_t max_steps)
+{
+    Machine_x86 &vm = *vm_pointer;
+    uint32_t pos = vm.program_size;
+    uint32_t pc = vm.pc;
+
+    pqp_compile(vm_pointer);
+    uint64_t perf_before[PERF_EVENTS_NUM];
+    if (vm.perf)
+    {
+        perf_open(vm);
+        Perf_block empty;
+        memset(&empty, 0, sizeof(empty));
+        vm.perf_blocks.resize(vm.program_size, empty);
+    }
+
+    for (uint64_t step = 0; pc < pos && vm.memory[pc] <= 0x0F; step++)
+    {
+        if (max_steps != 0 && step >= max_steps)
+        {
+            vm.pc = pc;
+            expand_profile(vm);
+            return RUN_STEP_LIMIT;
+        }
+
+        // Só volta para cá nas saídas de bloco (salto para pc não compilado ou para
+        // fora) e quando um laço compilado completa TIER2_THRESHOLD voltas.
+        // Cópia, não referência: compilar acrescenta contadores de bloco ao vetor
+        uint32_t hotness = vm.instruction_counts[HOTNESS_BASE + pc];
+
+        // O contador nunca fica em 0 sem o bloco compilado: quem o zera (a aresta de
+        // retorno no código gerado) sai para cá e o bloco é compilado em seguida
+        Pc_entry &entry = vm.dispatch_table[pc];
+        if (entry.native == nullptr && hotness > 1)
+        {
+            vm.instruction_counts[HOTNESS_BASE + pc] = hotness - 1;
+            uint64_t start = now_ns();
+            uint64_t start_cycles = __rdtsc();
+            if (vm.perf)
+            {
+                perf_read(vm, perf_before);
+            }
+            pc = interpret_block(vm, pc, vm.trace);
+            if (vm.perf)
+            {
+                perf_account(vm, vm.perf_interpreter, perf_before);
+            }
+            vm.run_cycles += __rdtsc() - start_cycles;
+            vm.run_ns += now_ns() - start;
+            continue;
+        }
+        if (entry.native == nullptr || (hotness == 0 && entry.loop_end != 0 && !entry.optimized))
+        {
+            uint64_t start = now_ns();
+            if (vm.perf)
+            {
+                perf_read(vm, perf_before);
+            }
+            if (entry.native == nullptr && code_changed(vm, pc))
+            {
+                invalidate_code(vm, pc);
+            }
+            unseal_code(vm, vm.code_size);
+            if (entry.native == nullptr)
+            {
+                compile_block(vm, pc, vm.trace);
+            }
+            else
+            {
+                compile_block(vm, pc, vm.trace, entry.loop_end);
+                entry.optimized = true;
+            }
+            seal_code(vm);
+            if (vm.perf)
+            {
+                perf_account(vm, vm.perf_compiler, perf_before);
+            }
+            vm.compile_ns += now_ns() - start;
+            vm.instruction_counts[HOTNESS_BASE + pc] = TIER2_THRESHOLD;
+        }
+
+        // O que sobra do limite vai para o código nativo, gasto nas arestas de
+        // retorno. Sem limite, o orçamento só faz o laço passar por aqui a cada
+        // 2^32 voltas.
+        uint32_t budget = max_steps != 0 ? (uint32_t)min<uint64_t>(max_steps - step, UINT32_MAX) : UINT32_MAX;
+        vm.instruction_counts[BUDGET_SLOT] = budget;
+
+        uint8_t *jit_addr = entry.native;
+        JitFunc func = (JitFunc)(vm.executable_code + PROLOGUE_OFFSET);
+        uint64_t start = now_ns();
+        uint64_t start_cycles = __rdtsc();
+        if (vm.perf)
+        {
+            perf_read(vm, perf_before);
+        }
+        uintptr_t result = func(&vm.registers[0], &vm.instruction_counts[0], vm.memory, vm.compare, jit_addr);
+        if (vm.perf)
+        {
+            perf_account(vm, vm.perf_blocks[pc], perf_before);
+        }
+        vm.run_cycles += __rdtsc() - start_cycles;
+        vm.run_ns += now_ns() - start;
+        step += budget - vm.instruction_counts[BUDGET_SLOT];
+
+        if (vm.instruction_counts[SMC_ADDRESS_SLOT] != NO_SMC)
+        {
+            uint32_t address = vm.instruction_counts[SMC_ADDRESS_SLOT];
+            vm.instruction_counts[SMC_ADDRESS_SLOT] = NO_SMC;
+            if (vm.count_instructions)
+            {
+                // O bloco foi contado inteiro na entrada, mas só executou até o store
+                uint32_t position = vm.instruction_counts[SMC_PROFILE_SLOT];
+                uint32_t block = upper_bound(vm.profile_blocks.begin(), vm.profile_blocks.end(), position - 1) -
+                                 vm.profile_blocks.begin() - 1;
+                vm.instruction_counts[block_counters_base(vm) + block]--;
+                for (uint32_t i = vm.profile_blocks[block]; i < position; i++)
+                {
+                    vm.instruction_counts[vm.profile_opcodes[i]]++;
+                }
+            }
+            start = now_ns();
+            invalidate_code(vm, address);
+            vm.compile_ns += now_ns() - start;
+        }
+
+        pc = (uint32_t)result;
+    }
+
+    vm.pc = pc;
+    expand_profile(vm);
+    return RUN_EXITED;
+}
+
+bool pqp_finish(Machine_x86 *vm)
+{
+    if (vm->trace.output != nullptr)
+    {
+        trace_close(vm->trace, *vm, trace_pc(*vm, vm->pc));
+    }
+    if (!vm->cache_dir.empty() && vm->code_size != vm->cached_size && !vm->code_modified)
+    {
+        save_code_cache(*vm, vm->cache_path.c_str(), vm->cache_key);
+        vm->cached_size = vm->code_size;
+    }
+    return true;
+}
+
+uint32_t pqp_pc(Machine_x86 *vm)
+{
+    return vm->pc;
+}
+
+int32_t pqp_register(Machine_x86 *vm, uint32_t r)
+{
+    return vm->registers[r % REGISTERS_NUM];
+}
+
+// Parada entre um cmp e o jcc fundido a ele: o jcc refaria o cmp com o valor
+// novo. Os operandos que o cmp viu vão para compare e o código é refeito com o
+// pc de retomada como destino de salto, onde a fusão não passa.
+void pqp_set_register(Machine_x86 *vm_pointer, uint32_t r, int32_t value)
+{
+    Machine_x86 &vm = *vm_pointer;
+    uint32_t last = vm.pc + FUSE_DISTANCE * INSTRUCTION_SIZE;
+
+    r %= REGISTERS_NUM;
+    for (uint32_t pc = vm.pc; vm.prepared && vm.registers[r] != value && pc < vm.program_size && pc < last;
+         pc += INSTRUCTION_SIZE)
+    {
+        uint32_t compare_pc = vm.decoded.compare[pc];
+
+        if (compare_pc < vm.pc && (vm.decoded.rx[compare_pc] == r || vm.decoded.ry[compare_pc] == r))
+        {
+            vm.compare[0] = vm.registers[vm.decoded.rx[compare_pc]];
+            vm.compare[1] = vm.registers[vm.decoded.ry[compare_pc]];
+            vm.resume_entries.push_back(vm.pc);
+            vm.code_modified = true;
+            flush_code(vm);
+            break;
+        }
+    }
+    vm.registers[r] = value;
+}
+
+uint8_t *pqp_memory(Machine_x86 *vm)
+{
+    return vm->memory;
+}
+
+uint64_t pqp_memory_size(Machine_x86 *vm)
+{
+    return vm->memory_size;
+}
+
+uint32_t pqp_instruction_count(Machine_x86 *vm, uint8_t opcode)
+{
+    return vm->instruction_counts[opcode % OPCODES_NUM];
+}
+
+void pqp_stats(Machine_x86 *vm, Run_stats &stats)
+{
+    stats.guest_instructions = 0;
+    for (int i = 0; i < OPCODES_NUM; i++)
+    {
+        stats.guest_instructions += vm->instruction_counts[i];
+    }
+    stats.compiled_instructions = vm->compiled_instructions;
+    stats.code_bytes = vm->relocations.empty() ? 0 : vm->code_size - prologue_end(*vm);
+    stats.compile_ns = vm->compile_ns;
+    stats.run_ns = vm->run_ns;
+    stats.run_cycles = vm->run_cycles;
+}
+
+uint32_t pqp_perf_blocks(Machine_x86 *vm, Perf_block *blocks, uint32_t max)
+{
+    vector<Perf_block> used;
+    // Ciclos, ou task-clock se não há contador de ciclos
+    int cost = vm->perf_fds[PERF_CYCLES] >= 0 ? PERF_CYCLES : PERF_TASK_CLOCK;
+
+    for (uint32_t pc = 0; pc < vm->perf_blocks.size(); pc++)
+    {
+        if (vm->perf_blocks[pc].entries != 0)
+        {
+            used.push_back(vm->perf_blocks[pc]);
+            used.back().pc = pc;
+        }
+    }
+    if (vm->perf_interpreter.entries != 0)
+    {
+        used.push_back(vm->perf_interpreter);
+    }
+    if (vm->perf_compiler.entries != 0)
+    {
+        used.push_back(vm->perf_compiler);
+    }
+    sort(used.begin(), used.end(), [cost](const Perf_block &a, const Perf_block &b)
+    {
+        return a.values[cost] > b.values[cost];
+    });
+    for (uint32_t i = 0; i < used.size() && i < max; i++)
+    {
+        blocks[i] = used[i];
+        for (int e = 0; e < PERF_EVENTS_NUM; e++)
+        {
+            if (vm->perf_fds[e] < 0)
+            {
+                blocks[i].values[e] = PERF_UNAVAILABLE;
+            }
+        }
+    }
+    return used.size();
+}
+
+Vm_snapshot *pqp_snapshot(Machine_x86 *vm_pointer)
+{
+    Machine_x86 &vm = *vm_pointer;
+    Vm_snapshot *snapshot = new Vm_snapshot();
+
+    snapshot->memory_size = vm.memory_size;
+    snapshot->count_instructions = vm.count_instructions;
+    snapshot->memory_fd = -1;
+    if (vm.memory_size + MEMORY_GUARD <= RESET_MEMSET_LIMIT)
+    {
+        snapshot->memory.assign(vm.memory, vm.memory + vm.memory_size + MEMORY_GUARD);
+    }
+    else if (!snapshot_memory(vm, *snapshot))
+    {
+        pqp_snapshot_destroy(snapshot);
+        return nullptr;
+    }
+
+    copy_state(*snapshot, vm);
+    snapshot->code.assign(vm.executable_code, vm.executable_code + vm.code_size);
+    snapshot->native_offsets.assign(vm.program_size, 0);
+    for (uint32_t pc = 0; pc < vm.program_size; pc++)
+    {
+        if (vm.dispatch_table[pc].native != nullptr)
+        {
+            snapshot->native_offsets[pc] = vm.dispatch_table[pc].native - vm.executable_code;
+        }
+    }
+    return snapshot;
+}
+
+void pqp_snapshot_destroy(Vm_snapshot *snapshot)
+{
+    if (snapshot->memory_fd >= 0)
+    {
+        close(snapshot->memory_fd);
+    }
+    delete snapshot;
+}
+
+// A VM é reiniciada e recebe o estado do snapshot: a memória por memcpy ou por
+// um mapeamento copy-on-write, o código por memcpy com as relocações refeitas
+bool pqp_restore(Machine_x86 *vm_pointer, const Vm_snapshot *snapshot)
+{
+    Machine_x86 &vm = *vm_pointer;
+
+    if (snapshot->memory_size != vm.memory_size || snapshot->count_instructions != vm.count_instructions)
+    {
+        return false;
+    }
+
+    if (!vm.reset())
+    {
+        return false;
+    }
+    if (snapshot->memory_fd < 0)
+    {
+        memcpy(vm.memory, snapshot->memory.data(), snapshot->memory.size());
+    }
+    else if (mmap(vm.memory, vm.memory_size + MEMORY_GUARD, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, snapshot->memory_fd, 0) == MAP_FAILED)
+    {
+        // O MAP_FIXED que falha pode ter desmapeado a memória: reset() a refaz
+        vm.reset();
+        return false;
+    }
+
+    copy_state(vm, *snapshot);
+    // O programa decodificado veio pronto, sem passar por decode_program()
+    vm.visited_pcs.assign(vm.program_size, 0);
+    vm.visit_generation = 0;
+    for (uint32_t pc = 0; pc < vm.program_size; pc++)
+    {
+        uint32_t offset = snapshot->native_offsets[pc];
+        vm.dispatch_table[pc].native = offset != 0 ? vm.executable_code + offset : nullptr;
+    }
+
+    if (!snapshot->code.empty())
+    {
+        unseal_code(vm, 0);
+        reserve_code(vm, snapshot->code.size());
+        memcpy(vm.executable_code, snapshot->code.data(), snapshot->code.size());
+        Pc_entry *table = vm.dispatch_table.data();
+        for (size_t i = 0; i < vm.relocations.size(); i++)
+        {
+            memcpy(vm.executable_code + vm.relocations[i], &table, sizeof(table));
+        }
+        vm.code_size = snapshot->code.size();
+        seal_code(vm);
+        if (vm.perf)
+        {
+            perf_map_code(vm, prologue_end(vm));
+        }
+    }
+    return true;
+}
+
+bool pqp_write_image(Machine_x86 *vm, const char *path)
+{
+    return write_image(*vm, path);
+}
+
+bool pqp_decode_trace(const char *input_path, const char *output_path)
+{
+    return decode_trace(input_path, output_path);
+}
@@ -0,0 +1,158 @@
+#ifndef PQP_H
+#define PQP_H
+
+#include <cstdint>
+
+// libpqp: a VM do PicoQuickProcessor com o compilador JIT, para embutir num
+// processo. Uma VM carrega um programa, executa em fatias e pode ser reiniciada
+// e reaproveitada para outro programa sem recriar a memória e o cache de código:
+//
+//   Vm_options options = {DEFAULT_MEMORY_BITS, TRACE_OFF, true, true, nullptr, false};
+//   Machine_x86 *vm = pqp_create(options);
+//   pqp_load(vm, "input.txt");
+//   while (pqp_run(vm, 1000) == RUN_STEP_LIMIT) { ... }
+//   int32_t r0 = pqp_register(vm, 0);
+//   pqp_destroy(vm);
+//
+// Uma VM só pode ser usada por uma thread de cada vez; VMs diferentes são
+// independentes.
+
+// Espaço de endereços da VM: 2^bits bytes, de 256 bytes (o padrão) até 4 GB
+#define DEFAULT_MEMORY_BITS 8
+#define MIN_MEMORY_BITS 8
+#define MAX_MEMORY_BITS 32
+
+enum Trace_mode
+{
+    TRACE_OFF,
+    TRACE_TEXT,
+    TRACE_BINARY
+};
+
+enum Run_status
+{
+    // O programa terminou (pc fora do programa ou opcode desconhecido)
+    RUN_EXITED,
+    // Acabaram os passos pedidos; pqp_run() continua de pqp_pc()
+    RUN_STEP_LIMIT
+};
+
+// Configuração fixa de uma VM, valendo para todos os programas que ela executar
+struct Vm_options
+{
+    uint32_t memory_bits;
+    // Log da execução, gravado na saída aberta por pqp_open_output()
+    Trace_mode trace_mode;
+    // false: sem contadores por opcode no código gerado. A saída fica sem a
+    // linha de contagem ([00:n,...,0F:n], entre o EXIT e os registradores), e
+    // pqp_instruction_count() e guest_instructions ficam em 0.
+    bool count_instructions;
+    // false: cache de código RWX em vez de W^X
+    bool write_xor_execute;
+    // Diretório do cache de código em disco, ou nullptr
+    const char *cache_dir;
+    // Modo perf: contadores do perf_event_open por bloco (pqp_perf_blocks()) e
+    // os símbolos pqp_block_0xNNNN do código gerado em /tmp/perf-<pid>.map,
+    // para o perf report
+    bool perf;
+};
+
+// Números de uma execução (desde o último pqp_load)
+struct Run_stats
+{
+    uint64_t guest_instructions;
+    uint32_t compiled_instructions;
+    uint32_t code_bytes;
+    uint64_t compile_ns;
+    uint64_t run_ns;
+    uint64_t run_cycles;
+};
+
+// Eventos contados no modo perf. O task-clock (ns) é de software e existe
+// mesmo sem contadores de hardware (em VMs, por exemplo).
+enum Perf_event
+{
+    PERF_TASK_CLOCK,
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_EVENTS_NUM
+};
+
+// Evento que o kernel ou a CPU não oferecem
+#define PERF_UNAVAILABLE UINT64_MAX
+// pc dos totais do interpretador e do compilador em pqp_perf_blocks()
+#define PERF_INTERPRETER 0xFFFFFFFF
+#define PERF_COMPILER 0xFFFFFFFE
+
+// O que o código nativo gastou nas entradas por pc, desde o último pqp_load.
+// Os contadores são lidos ao entrar no código nativo vindo do despachante e ao
+// voltar para ele, então os blocos encadeados depois da entrada contam para o
+// bloco de entrada; o perf record com o mapa separa o resto.
+struct Perf_block
+{
+    uint32_t pc;
+    uint64_t entries;
+    uint64_t values[PERF_EVENTS_NUM];
+};
+
+struct Machine_x86;
+
+// nullptr se não há espaço de endereços para a memória ou o cache de código
+Machine_x86 *pqp_create(const Vm_options &options);
+void pqp_destroy(Machine_x86 *vm);
+// Volta ao estado de uma VM recém-criada, mantendo as opções. false se a
+// memória não pôde ser remapeada; a VM então só serve para pqp_destroy(), e
+// pqp_load() e pqp_restore() também falham nela.
+bool pqp_reset(Machine_x86 *vm);
+
+// Programa em texto (bytes em hexadecimal) ou imagem binária. Carregar outro
+// programa numa VM já usada a reinicia antes.
+bool pqp_load(Machine_x86 *vm, const char *path);
+// Arquivo que recebe o log e, em pqp_finish(), o estado final. Opcional; vem
+// depois de pqp_load() e antes da primeira execução.
+bool pqp_open_output(Machine_x86 *vm, const char *path);
+// Prepara a execução: análise do programa, prólogo e cache de código em disco.
+// pqp_run() chama sozinho se preciso.
+bool pqp_compile(Machine_x86 *vm);
+// Executa até o programa terminar ou até max_steps passos (0 = sem limite). Um
+// passo é uma volta do despachante (um bloco interpretado ou uma entrada no
+// código nativo) ou uma volta de laço no código nativo, então um programa que
+// não termina também devolve a thread depois de max_steps passos.
+Run_status pqp_run(Machine_x86 *vm, uint64_t max_steps);
+// Grava o estado final na saída e o código novo no cache em disco
+bool pqp_finish(Machine_x86 *vm);
+
+uint32_t pqp_pc(Machine_x86 *vm);
+int32_t pqp_register(Machine_x86 *vm, uint32_t r);
+// Vale também parado entre um cmp e o seu jcc: o jcc usa os valores que o cmp
+// comparou
+void pqp_set_register(Machine_x86 *vm, uint32_t r, int32_t value);
+uint8_t *pqp_memory(Machine_x86 *vm);
+uint64_t pqp_memory_size(Machine_x86 *vm);
+uint32_t pqp_instruction_count(Machine_x86 *vm, uint8_t opcode);
+void pqp_stats(Machine_x86 *vm, Run_stats &stats);
+// Copia até max blocos com alguma entrada, do mais caro (em ciclos, ou em
+// task-clock sem ciclos) para o mais barato, e devolve quantos há
+uint32_t pqp_perf_blocks(Machine_x86 *vm, Perf_block *blocks, uint32_t max);
+
+// Estado completo da VM (registradores, memória, flags, contadores e código
+// compilado) num pc de retomada, por exemplo depois da inicialização do
+// programa. pqp_restore() o copia para outra VM (ou para a mesma), que continua
+// com pqp_run() dali. A VM de destino precisa ter o mesmo memory_bits e
+// count_instructions; a saída não faz parte do snapshot e é aberta depois. Um
+// snapshot não muda depois de criado e pode ser restaurado por várias threads
+// ao mesmo tempo.
+struct Vm_snapshot;
+
+Vm_snapshot *pqp_snapshot(Machine_x86 *vm);
+bool pqp_restore(Machine_x86 *vm, const Vm_snapshot *snapshot);
+void pqp_snapshot_destroy(Vm_snapshot *snapshot);
+
+// Grava o programa carregado como imagem binária
+bool pqp_write_image(Machine_x86 *vm, const char *path);
+// Converte um log binário para o formato texto
+bool pqp_decode_trace(const char *input_path, const char *output_path);
+
+#endif
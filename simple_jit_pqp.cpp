@@ -1,652 +1,379 @@
-#include <iostream>
+#include "pqp.h"
+
 #include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
 #include <cstdint>
-#include <sys/mman.h>
-#include <unistd.h>
 #include <string.h>
 #include <cstdio>
+#include <cstdlib>
 
 using namespace std;
 
-#define REGISTERS_NUM 16
-#define MEMORY_SIZE 256
-#define INSTRUCTION_SIZE 4
-#define SIZE_CODE 1024
-#define PAGE_SIZE 4096
-
-using JitFunc = uintptr_t (*)(int32_t *, uint32_t *, uint8_t *, uint32_t *);
+// Linha de comando sobre a libpqp (pqp.h): um programa, um lote de programas
+// ou as conversões de imagem e de log
 
-struct Machine_x86
+struct Run_options
 {
-    vector<int32_t> registers;
-    vector<uint8_t> memory;
-    bool compare[3];
-    uint32_t save_bool;
-    vector<uint32_t> instruction_counts;
-    vector<bool> not_interpreted;
-
-    uint8_t *executable_code;
-    uintptr_t code_base;
+    Vm_options vm;
+    const char *stats_path;
+    const char *perf_path;
+};
 
-    Machine_x86() : registers(REGISTERS_NUM, 0),
-                    memory(MEMORY_SIZE, 0),
-                    compare{false, false, false},
-                    save_bool(0),
-                    instruction_counts(REGISTERS_NUM, 0),
-                    not_interpreted(MEMORY_SIZE, true)
+// Texto para dentro de uma string JSON: aspas, barras invertidas e caracteres
+// de controle escapados (o caminho do programa pode ter qualquer um deles)
+static string json_escape(const char *text)
+{
+    string escaped;
+    for (const char *c = text; *c != '\0'; c++)
     {
-        executable_code = (uint8_t *)mmap(nullptr, PAGE_SIZE,
-                                          PROT_READ | PROT_WRITE | PROT_EXEC,
-                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-
-        code_base = (uintptr_t)executable_code;
-
-        memset(executable_code, 0x90, PAGE_SIZE);
-        executable_code[PAGE_SIZE - 1] = 0xC3;
-
-        for (uint32_t i = 0; i < SIZE_CODE; i += 16)
+        if (*c == '"' || *c == '\\')
+        {
+            escaped += '\\';
+            escaped += *c;
+        }
+        else if ((unsigned char)*c < 0x20)
+        {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", (unsigned char)*c);
+            escaped += code;
+        }
+        else
         {
-            executable_code[i] = 0x48;
-            executable_code[i + 1] = 0x8D;
-            executable_code[i + 2] = 0x05;
-            executable_code[i + 3] = 0x00;
-            executable_code[i + 4] = 0x00;
-            executable_code[i + 5] = 0x00;
-            executable_code[i + 6] = 0x00;
-            executable_code[i + 7] = 0xC3;
+            escaped += *c;
         }
     }
+    return escaped;
+}
 
-    ~Machine_x86()
+// Uma linha JSON por execução, acrescentada ao arquivo (as threads do modo
+// lote escrevem no mesmo arquivo)
+static bool write_stats(const char *path, const char *input_path, const Run_stats &stats)
+{
+    static mutex stats_mutex;
+    uint64_t instructions = stats.guest_instructions;
+
+    lock_guard<mutex> lock(stats_mutex);
+    FILE *output = fopen(path, "a");
+    if (output == nullptr)
     {
-        munmap(executable_code, PAGE_SIZE);
+        return false;
     }
-};
-
-int main(int argc, char *argv[])
+    fprintf(output,
+            "{\"program\":\"%s\",\"guest_instructions\":%llu,\"compiled_instructions\":%u,"
+            "\"code_bytes\":%u,\"compile_ns\":%llu,\"run_ns\":%llu,\"run_cycles\":%llu,"
+            "\"ns_per_instruction\":%.4f,\"cycles_per_instruction\":%.4f,\"code_bytes_per_instruction\":%.2f}\n",
+            json_escape(input_path).c_str(), (unsigned long long)instructions, stats.compiled_instructions,
+            stats.code_bytes, (unsigned long long)stats.compile_ns, (unsigned long long)stats.run_ns,
+            (unsigned long long)stats.run_cycles,
+            instructions ? (double)stats.run_ns / instructions : 0.0,
+            instructions ? (double)stats.run_cycles / instructions : 0.0,
+            stats.compiled_instructions ? (double)stats.code_bytes / stats.compiled_instructions : 0.0);
+    return fclose(output) == 0;
+}
+
+// Contador em JSON: null quando o evento não abriu
+static void write_perf_value(FILE *output, const char *name, uint64_t value)
 {
-    FILE *input = fopen(argv[1], "r");
-    Machine_x86 vm;
-
-    uint16_t pos = 0;
-    uint16_t hex_value;
-    while (fscanf(input, "%hx", &hex_value) == 1 && pos < MEMORY_SIZE)
+    if (value == PERF_UNAVAILABLE)
     {
-        vm.memory[pos++] = (uint8_t)hex_value;
+        fprintf(output, ",\"%s\":null", name);
     }
-    fclose(input);
-
-    FILE *output = fopen(argv[2], "w");
+    else
+    {
+        fprintf(output, ",\"%s\":%llu", name, (unsigned long long)value);
+    }
+}
 
-    uint16_t pc = 0;
-    while (pc < pos)
+// Uma linha JSON por bloco de entrada (e pelo interpretador e pelo compilador),
+// do mais caro para o mais barato
+static bool write_perf(const char *path, const char *input_path, Machine_x86 *vm)
+{
+    static mutex perf_mutex;
+    vector<Perf_block> blocks(pqp_perf_blocks(vm, nullptr, 0));
+    pqp_perf_blocks(vm, blocks.data(), blocks.size());
+    string program = json_escape(input_path);
+
+    lock_guard<mutex> lock(perf_mutex);
+    FILE *output = fopen(path, "a");
+    if (output == nullptr)
+    {
+        return false;
+    }
+    for (const Perf_block &block : blocks)
     {
-        if (vm.not_interpreted[pc])
+        char name[32];
+        if (block.pc == PERF_INTERPRETER)
         {
-            uint8_t opcode = vm.memory[pc];
-            uint32_t index = pc * 4;
-
-            vm.not_interpreted[pc] = false;
-
-            switch (opcode)
-            {
-            case 0x00: // mov rx, i16 (10 bytes)
-            {
-                uint8_t rx = vm.memory[pc + 1] >> 4;
-                int32_t i32 = (int16_t)(vm.memory[pc + 2] | (vm.memory[pc + 3] << 8));
-
-                fprintf(output, "0x%04X->MOV_R%d=0x%08X\n", pc, (int)rx, (uint32_t)i32);
-
-                rx = rx * 4;
-                // mov dword ptr [rdi + rx], i32 (7 bytes)
-                vm.executable_code[index++] = 0xC7;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = rx;
-                vm.executable_code[index++] = (i32 >> 0) & 0xFF;
-                vm.executable_code[index++] = (i32 >> 8) & 0xFF;
-                vm.executable_code[index++] = (i32 >> 16) & 0xFF;
-                vm.executable_code[index++] = (i32 >> 24) & 0xFF;
-                // inc dword ptr [rsi] (3 bytes)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x06;
-                break;
-            }
-
-            case 0x01: // mov rx, ry (14 bytes)
-            {
-                uint8_t rx = vm.memory[pc + 1] >> 4;
-                uint8_t ry = vm.memory[pc + 1] & 0x0F;
-
-                fprintf(output, "0x%04X->MOV_R%d=R%d=0x%08X\n", pc, (int)rx, (int)ry, vm.registers[ry]);
-
-                rx = rx * 4;
-                ry = ry * 4;
-                // mov eax, dword ptr [rdi + ry] (3 bytes)
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = ry;
-                // mov dword ptr [rdi + rx], eax (3 bytes)
-                vm.executable_code[index++] = 0x89;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = rx;
-                // inc dword ptr [rsi + 8] (4 bytes)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x08;
-
-                break;
-            }
-
-            case 0x02: // mov rx, [ry] (11 bytes)
-            {
-                uint8_t rx = vm.memory[pc + 1] >> 4;
-                uint8_t ry = vm.memory[pc + 1] & 0x0F;
-                uint32_t address = vm.registers[ry];
-
-                fprintf(output, "0x%04X->MOV_R%d=MEM[0x%02X,0x%02X,0x%02X,0x%02X]=[0x%02X,0x%02X,0x%02X,0x%02X]\n",
-                        pc, (int)rx, address, address + 1, address + 2, address + 3,
-                        (int)vm.memory[address], (int)vm.memory[address + 1],
-                        (int)vm.memory[address + 2], (int)vm.memory[address + 3]);
-
-                rx = rx * 4;
-                ry = ry * 4;
-                // mov eax, dword ptr [rdi + ry] (3 bytes)
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = ry;
-                // mov eax, dword ptr [rdx + rax] (3 bytes)
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x04;
-                vm.executable_code[index++] = 0x02;
-                // mov dword ptr [rdi + rx], eax (3 bytes)
-                vm.executable_code[index++] = 0x89;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = rx;
-                // inc dword ptr [rsi + 16] (4 bytes) - incrementa count[2] (2*8)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x10;
-
-                break;
-            }
-
-            case 0x03: // mov [rx], ry (11 bytes)
-            {
-                uint8_t rx = vm.memory[pc + 1] >> 4;
-                uint8_t ry = vm.memory[pc + 1] & 0x0F;
-                uint32_t address = vm.registers[rx];
-                int32_t value = vm.registers[ry];
-
-                uint8_t temp1 = (value & 0x000000FF);
-                uint8_t temp2 = (value & 0x0000FF00) >> 8;
-                uint8_t temp3 = (value & 0x00FF0000) >> 16;
-                uint8_t temp4 = (value & 0xFF000000) >> 24;
-
-                fprintf(output, "0x%04X->MOV_MEM[0x%02X,0x%02X,0x%02X,0x%02X]=R%d=[0x%02X,0x%02X,0x%02X,0x%02X]\n",
-                        pc, address, address + 1, address + 2, address + 3, (int)ry,
-                        (int)temp1, (int)temp2, (int)temp3, (int)temp4);
-
-                rx = rx * 4;
-                ry = ry * 4;
-                // mov eax, dword ptr [rdi + rx] (3 bytes)
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = rx;
-                // mov ecx, dword ptr [rdi + ry] (3 bytes)
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x4F;
-                vm.executable_code[index++] = ry;
-                // mov dword ptr [rdx + rax], ecx (3 bytes) - agora rdx é memory
-                vm.executable_code[index++] = 0x89;
-                vm.executable_code[index++] = 0x0C;
-                vm.executable_code[index++] = 0x02;
-                // inc dword ptr [rsi + 24] (4 bytes) - incrementa count[3] (3*8)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x18;
-
-                break;
-            }
+            strcpy(name, "interpreter");
+        }
+        else if (block.pc == PERF_COMPILER)
+        {
+            strcpy(name, "compiler");
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "pqp_block_0x%04X", block.pc);
+        }
+        fprintf(output, "{\"program\":\"%s\",\"block\":\"%s\",\"entries\":%llu", program.c_str(), name,
+                (unsigned long long)block.entries);
+        write_perf_value(output, "task_clock_ns", block.values[PERF_TASK_CLOCK]);
+        write_perf_value(output, "cycles", block.values[PERF_CYCLES]);
+        write_perf_value(output, "instructions", block.values[PERF_INSTRUCTIONS]);
+        write_perf_value(output, "branch_misses", block.values[PERF_BRANCH_MISSES]);
+        write_perf_value(output, "l1d_misses", block.values[PERF_L1D_MISSES]);
+        fprintf(output, "}\n");
+    }
+    return fclose(output) == 0;
+}
 
-            case 0x04: // cmp rx, ry (14 bytes)
-            {
-                uint8_t rx = vm.memory[pc + 1] >> 4;
-                uint8_t ry = vm.memory[pc + 1] & 0x0F;
-                int32_t val_rx = vm.registers[rx];
-                int32_t val_ry = vm.registers[ry];
+// Executa um programa numa VM recém-criada ou já usada
+static bool run_program(Machine_x86 *vm, const Run_options &options, const char *input_path, const char *output_path)
+{
+    if (!pqp_load(vm, input_path))
+    {
+        fprintf(stderr, "cannot load %s\n", input_path);
+        return false;
+    }
+    if (!pqp_open_output(vm, output_path))
+    {
+        fprintf(stderr, "cannot open %s\n", output_path);
+        return false;
+    }
 
-                vm.compare[0] = val_rx > val_ry;
-                vm.compare[1] = val_rx < val_ry;
-                vm.compare[2] = val_rx == val_ry;
+    pqp_run(vm, 0);
+    pqp_finish(vm);
 
-                fprintf(output, "0x%04X->CMP_R%d<=>R%d(G=%d,L=%d,E=%d)\n",
-                        pc, (int)rx, (int)ry, vm.compare[0], vm.compare[1], vm.compare[2]);
+    if (options.stats_path != nullptr)
+    {
+        Run_stats stats;
+        pqp_stats(vm, stats);
+        write_stats(options.stats_path, input_path, stats);
+    }
+    if (options.perf_path != nullptr)
+    {
+        write_perf(options.perf_path, input_path, vm);
+    }
+    return true;
+}
 
-                rx = rx * 4;
-                ry = ry * 4;
+// Modo lote: cada linha do manifesto é um par "entrada saída". Cada thread do
+// pool tem a sua VM (com o seu cache de código), reiniciada entre programas.
+static bool run_batch(const Run_options &options, const char *manifest_path, unsigned jobs)
+{
+    FILE *manifest = fopen(manifest_path, "r");
+    vector<pair<string, string>> runs;
+    char input_path[4096];
+    char output_path[4096];
 
-                // mov eax, dword ptr [rdi + rx] (3 bytes)
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = rx;
-                // cmp eax, dword ptr [rdi + ry] (3 bytes)
-                vm.executable_code[index++] = 0x3B;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = ry;
-                // pushf (1 byte)
-                vm.executable_code[index++] = 0x9C;
-                // pop rax (1 byte)
-                vm.executable_code[index++] = 0x58;
-                // mov dword ptr [rcx], eax (2 bytes)
-                vm.executable_code[index++] = 0x89;
-                vm.executable_code[index++] = 0x01;
-                // inc qword ptr [rsi + 32] (4 bytes) - incrementa count[4] (4*8)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x20;
+    if (manifest == nullptr)
+    {
+        fprintf(stderr, "cannot open %s\n", manifest_path);
+        return false;
+    }
+    while (fscanf(manifest, "%4095s %4095s", input_path, output_path) == 2)
+    {
+        runs.push_back(make_pair(string(input_path), string(output_path)));
+    }
+    fclose(manifest);
 
-                break;
-            }
+    atomic<size_t> next(0);
+    atomic<bool> succeeded(true);
+    vector<thread> workers;
 
-            case 0x05: // jmp i16 (9 bytes)
+    for (unsigned i = 0; i < jobs && i < runs.size(); i++)
+    {
+        workers.push_back(thread([&]()
+        {
+            Machine_x86 *vm = pqp_create(options.vm);
+            if (vm == nullptr)
             {
-                int32_t offset = (int16_t)(vm.memory[pc + 2] | (vm.memory[pc + 3] << 8));
-                uint32_t target_pc = pc + INSTRUCTION_SIZE + offset;
-
-                fprintf(output, "0x%04X->JMP_0x%04X\n", pc, (uint16_t)target_pc);
-
-                // inc counter (4 bytes)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x28;
-
-                if (target_pc >= MEMORY_SIZE)
-                {
-                    // mov eax, target_pc (5 bytes)
-                    vm.executable_code[index++] = 0xB8;
-                    vm.executable_code[index++] = (target_pc >> 0) & 0xFF;
-                    vm.executable_code[index++] = (target_pc >> 8) & 0xFF;
-                    vm.executable_code[index++] = (target_pc >> 16) & 0xFF;
-                    vm.executable_code[index++] = (target_pc >> 24) & 0xFF;
-                    // ret (1 byte)
-                    vm.executable_code[index++] = 0xC3;
-                }
-                else
-                {
-                    // jmp rel32 normal (5 bytes)
-                    int32_t jump_code = (target_pc - pc) * 4 - 9;
-                    vm.executable_code[index++] = 0xE9;
-                    vm.executable_code[index++] = (jump_code >> 0) & 0xFF;
-                    vm.executable_code[index++] = (jump_code >> 8) & 0xFF;
-                    vm.executable_code[index++] = (jump_code >> 16) & 0xFF;
-                    vm.executable_code[index++] = (jump_code >> 24) & 0xFF;
-                }
-
-                break;
+                fprintf(stderr, "cannot create VM\n");
+                succeeded = false;
+                return;
             }
-
-            case 0x06: // jg i16 (14 bytes)
+            for (size_t run = next++; run < runs.size(); run = next++)
             {
-                int32_t offset = (int16_t)(vm.memory[pc + 2] | (vm.memory[pc + 3] << 8));
-                uint32_t target_pc = pc + INSTRUCTION_SIZE + offset;
-                int32_t jump_code = (target_pc - pc) * 4 - 14;
-
-                fprintf(output, "0x%04X->JG_0x%04X\n", pc, (uint16_t)target_pc);
-
-                // inc counter + restore flags (8 bytes) // inc qword ptr [rsi + 48]
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x30;
-                vm.executable_code[index++] = 0x8B; // mov eax, [rcx]
-                vm.executable_code[index++] = 0x01;
-                vm.executable_code[index++] = 0x50; // push rax
-                vm.executable_code[index++] = 0x9D; // popf
-
-                if (target_pc >= MEMORY_SIZE)
-                {
-                    // jle +6 (pula mov+ret se condição falsa) (2 bytes)
-                    vm.executable_code[index++] = 0x7E; // jle rel8 (+6)
-                    vm.executable_code[index++] = 0x06;
-
-                    // mov eax, target_pc (5 bytes) - só executa se jg for verdadeiro
-                    vm.executable_code[index++] = 0xB8;
-                    vm.executable_code[index++] = (target_pc >> 0) & 0xFF;
-                    vm.executable_code[index++] = (target_pc >> 8) & 0xFF;
-                    vm.executable_code[index++] = (target_pc >> 16) & 0xFF;
-                    vm.executable_code[index++] = (target_pc >> 24) & 0xFF;
-
-                    // ret (1 byte) - retorna target_pc se condição verdadeira
-                    vm.executable_code[index++] = 0xC3;
-                }
-                else
+                if (!run_program(vm, options, runs[run].first.c_str(), runs[run].second.c_str()))
                 {
-                    // Jump condicional nativo normal
-                    // jg rel32 (6 bytes)
-                    vm.executable_code[index++] = 0x0F;
-                    vm.executable_code[index++] = 0x8F;
-                    vm.executable_code[index++] = (jump_code >> 0) & 0xFF;
-                    vm.executable_code[index++] = (jump_code >> 8) & 0xFF;
-                    vm.executable_code[index++] = (jump_code >> 16) & 0xFF;
-                    vm.executable_code[index++] = (jump_code >> 24) & 0xFF;
+                    succeeded = false;
                 }
-                break;
             }
+            pqp_destroy(vm);
+        }));
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    return succeeded;
+}
 
-            case 0x07: // jl i16 (14 bytes)
+int main(int argc, char *argv[])
+{
+    uint32_t memory_bits = DEFAULT_MEMORY_BITS;
+    const char *image_path = nullptr;
+    Trace_mode trace_mode = TRACE_TEXT;
+    bool count_instructions = true;
+    bool write_xor_execute = true;
+    const char *cache_dir = nullptr;
+    const char *batch_path = nullptr;
+    const char *stats_path = nullptr;
+    const char *perf_path = nullptr;
+    unsigned jobs = thread::hardware_concurrency() > 0 ? thread::hardware_concurrency() : 1;
+    int arg = 1;
+
+    // simple_jit_pqp [--mem-bits N] [--trace off|text|binary] [--counters profile|off] [--code-pages wx|rwx] [--code-cache dir] [--stats file] [--perf file] input output
+    // simple_jit_pqp [--mem-bits N] [--trace off|text|binary] [--counters profile|off] [--code-pages wx|rwx] [--code-cache dir] [--stats file] [--perf file] [--jobs N] --batch manifest
+    // simple_jit_pqp [--mem-bits N] --make-image image input
+    // simple_jit_pqp --decode-trace trace output
+    // Com --counters off a saída não tem a linha de contagem e o --stats
+    // informa guest_instructions 0.
+    while (arg + 1 < argc && strncmp(argv[arg], "--", 2) == 0)
+    {
+        if (strcmp(argv[arg], "--mem-bits") == 0)
+        {
+            memory_bits = atoi(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--make-image") == 0)
+        {
+            image_path = argv[arg + 1];
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--trace") == 0)
+        {
+            if (strcmp(argv[arg + 1], "off") == 0)
             {
-                int32_t offset = (int16_t)(vm.memory[pc + 2] | (vm.memory[pc + 3] << 8));
-
-                uint32_t target_pc = pc + INSTRUCTION_SIZE + offset;
-
-                fprintf(output, "0x%04X->JL_0x%04X\n", pc, (uint16_t)target_pc);
-
-                // inc counter + restore flags (8 bytes)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x38;
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x01;
-                vm.executable_code[index++] = 0x50;
-                vm.executable_code[index++] = 0x9D;
-
-                if (target_pc >= MEMORY_SIZE)
-                {
-                    // jge +6 (pula mov+ret se condição falsa) (2 bytes)
-                    vm.executable_code[index++] = 0x7D; // jge rel8 (+6)
-                    vm.executable_code[index++] = 0x06;
-
-                    // mov eax, target_pc (5 bytes) - só executa se jl for verdadeiro
-                    vm.executable_code[index++] = 0xB8;
-                    vm.executable_code[index++] = (target_pc >> 0) & 0xFF;
-                    vm.executable_code[index++] = (target_pc >> 8) & 0xFF;
-                    vm.executable_code[index++] = (target_pc >> 16) & 0xFF;
-                    vm.executable_code[index++] = (target_pc >> 24) & 0xFF;
-
-                    // ret (1 byte)
-                    vm.executable_code[index++] = 0xC3;
-                }
-                else
-                {
-                    // jl rel32 (6 bytes)
-                    int32_t jump_code = (target_pc - pc) * 4 - 14;
-                    vm.executable_code[index++] = 0x0F;
-                    vm.executable_code[index++] = 0x8C;
-                    vm.executable_code[index++] = (jump_code >> 0) & 0xFF;
-                    vm.executable_code[index++] = (jump_code >> 8) & 0xFF;
-                    vm.executable_code[index++] = (jump_code >> 16) & 0xFF;
-                    vm.executable_code[index++] = (jump_code >> 24) & 0xFF;
-                }
-
-                break;
+                trace_mode = TRACE_OFF;
             }
-
-            case 0x08: // je i16 (14 bytes)
+            else if (strcmp(argv[arg + 1], "binary") == 0)
             {
-                int32_t offset = (int16_t)(vm.memory[pc + 2] | (vm.memory[pc + 3] << 8));
-                uint32_t target_pc = pc + INSTRUCTION_SIZE + offset;
-
-                fprintf(output, "0x%04X->JE_0x%04X\n", pc, (uint16_t)target_pc);
-
-                // inc counter + restore flags (8 bytes)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x40;
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x01;
-                vm.executable_code[index++] = 0x50;
-                vm.executable_code[index++] = 0x9D;
-
-                if (target_pc >= MEMORY_SIZE)
-                {
-                    // mov eax, target_pc (5 bytes) - só executa se je for verdadeiro
-                    vm.executable_code[index++] = 0xB8;
-                    vm.executable_code[index++] = (target_pc >> 0) & 0xFF;
-                    vm.executable_code[index++] = (target_pc >> 8) & 0xFF;
-                    vm.executable_code[index++] = (target_pc >> 16) & 0xFF;
-                    vm.executable_code[index++] = (target_pc >> 24) & 0xFF;
-
-                    // ret (1 byte)
-                    vm.executable_code[index++] = 0xC3;
-                }
-                else
-                {
-                    // je rel32 (6 bytes)
-                    int32_t jump_code = (target_pc - pc) * 4 - 14;
-                    vm.executable_code[index++] = 0x0F;
-                    vm.executable_code[index++] = 0x84;
-                    vm.executable_code[index++] = (jump_code >> 0) & 0xFF;
-                    vm.executable_code[index++] = (jump_code >> 8) & 0xFF;
-                    vm.executable_code[index++] = (jump_code >> 16) & 0xFF;
-                    vm.executable_code[index++] = (jump_code >> 24) & 0xFF;
-                }
-                break;
+                trace_mode = TRACE_BINARY;
             }
-
-            case 0x09: // add rx, ry (10 bytes)
+            else if (strcmp(argv[arg + 1], "text") == 0)
             {
-                uint8_t rx = vm.memory[pc + 1] >> 4;
-                uint8_t ry = vm.memory[pc + 1] & 0x0F;
-                int32_t temp_rx = vm.registers[rx];
-                int32_t temp = vm.registers[rx] + vm.registers[ry];
-
-                fprintf(output, "0x%04X->ADD_R%d+=R%d=0x%08X+0x%08X=0x%08X\n",
-                        pc, (int)rx, (int)ry, temp_rx, vm.registers[ry], temp);
-
-                rx = rx * 4;
-                ry = ry * 4;
-                // mov eax, dword ptr [rdi + ry] (3 bytes)
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = ry;
-                // add dword ptr [rdi + rx], eax (3 bytes)
-                vm.executable_code[index++] = 0x01;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = rx;
-                // inc dword ptr [rsi + 72] (4 bytes)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-
-                break;
+                trace_mode = TRACE_TEXT;
             }
-
-            case 0x0A: // sub rx, ry (10 bytes)
+            else
             {
-                uint8_t rx = vm.memory[pc + 1] >> 4;
-                uint8_t ry = vm.memory[pc + 1] & 0x0F;
-                int32_t temp_rx = vm.registers[rx];
-                int32_t temp = vm.registers[rx] - vm.registers[ry];
-
-                fprintf(output, "0x%04X->SUB_R%d-=R%d=0x%08X-0x%08X=0x%08X\n",
-                        pc, (int)rx, (int)ry, temp_rx, vm.registers[ry], temp);
-
-                rx = rx * 4;
-                ry = ry * 4;
-                // mov eax, dword ptr [rdi + ry] (3 bytes)
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = ry;
-                // sub dword ptr [rdi + rx], eax (3 bytes)
-                vm.executable_code[index++] = 0x29;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = rx;
-                // inc dword ptr [rsi + 80] (4 bytes)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x50;
-
                 break;
             }
-
-            case 0x0B: // and rx, ry (10 bytes)
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--counters") == 0)
+        {
+            if (strcmp(argv[arg + 1], "off") == 0)
             {
-                uint8_t rx = vm.memory[pc + 1] >> 4;
-                uint8_t ry = vm.memory[pc + 1] & 0x0F;
-                int32_t temp_rx = vm.registers[rx];
-                int32_t temp = vm.registers[rx] & vm.registers[ry];
-
-                fprintf(output, "0x%04X->AND_R%d&=R%d=0x%08X&0x%08X=0x%08X\n",
-                        pc, (int)rx, (int)ry, temp_rx, vm.registers[ry], temp);
-
-                rx = rx * 4;
-                ry = ry * 4;
-                // mov eax, dword ptr [rdi + ry] (3 bytes)
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = ry;
-                // and dword ptr [rdi + rx], eax (3 bytes)
-                vm.executable_code[index++] = 0x21;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = rx;
-                // inc dword ptr [rsi + 88] (4 bytes)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x58;
-                break;
+                count_instructions = false;
             }
-
-            case 0x0C: // or rx, ry (10 bytes)
+            else if (strcmp(argv[arg + 1], "profile") == 0)
             {
-                uint8_t rx = vm.memory[pc + 1] >> 4;
-                uint8_t ry = vm.memory[pc + 1] & 0x0F;
-                int32_t temp_rx = vm.registers[rx];
-                int32_t temp = vm.registers[rx] | vm.registers[ry];
-
-                fprintf(output, "0x%04X->OR_R%d|=R%d=0x%08X|0x%08X=0x%08X\n",
-                        pc, (int)rx, (int)ry, temp_rx, vm.registers[ry], temp);
-
-                rx = rx * 4;
-                ry = ry * 4;
-                // mov eax, dword ptr [rdi + ry] (3 bytes)
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = ry;
-                // or dword ptr [rdi + rx], eax (3 bytes)
-                vm.executable_code[index++] = 0x09;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = rx;
-                // inc dword ptr [rsi + 96] (4 bytes)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x60;
-                break;
+                count_instructions = true;
             }
-
-            case 0x0D: // xor rx, ry (10 bytes)
+            else
             {
-                uint8_t rx = vm.memory[pc + 1] >> 4;
-                uint8_t ry = vm.memory[pc + 1] & 0x0F;
-                int32_t temp_rx = vm.registers[rx];
-                int32_t temp = vm.registers[rx] ^ vm.registers[ry];
-
-                fprintf(output, "0x%04X->XOR_R%d^=R%d=0x%08X^0x%08X=0x%08X\n",
-                        pc, (int)rx, (int)ry, temp_rx, vm.registers[ry], temp);
-
-                rx = rx * 4;
-                ry = ry * 4;
-                // mov eax, dword ptr [rdi + ry] (3 bytes)
-                vm.executable_code[index++] = 0x8B;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = ry;
-                // xor dword ptr [rdi + rx], eax (3 bytes)
-                vm.executable_code[index++] = 0x31;
-                vm.executable_code[index++] = 0x47;
-                vm.executable_code[index++] = rx;
-                // inc dword ptr [rsi + 104] (4 bytes)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x68;
-
                 break;
             }
-
-            case 0x0E: // sal rx, i5 (8 bytes)
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--code-pages") == 0)
+        {
+            if (strcmp(argv[arg + 1], "wx") == 0)
             {
-                uint8_t rx = vm.memory[pc + 1] >> 4;
-                uint8_t shift_left = vm.memory[pc + 3] & 0x1F;
-                int32_t temp_rx = vm.registers[rx];
-                int32_t temp = vm.registers[rx] << shift_left;
-
-                fprintf(output, "0x%04X->SAL_R%d<<=%d=0x%08X<<%d=0x%08X\n",
-                        pc, (int)rx, (int)shift_left, temp_rx, (int)shift_left, temp);
-
-                rx = rx * 4;
-                // shl dword ptr [rdi + rx], shift_left (4 bytes)
-                vm.executable_code[index++] = 0xC1;
-                vm.executable_code[index++] = 0x67;
-                vm.executable_code[index++] = rx;
-                vm.executable_code[index++] = shift_left;
-                // inc dword ptr [rsi + 112] (4 bytes)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x70;
-
-                break;
+                write_xor_execute = true;
             }
-
-            case 0x0F: // sar rx, i5 (8 bytes)
+            else if (strcmp(argv[arg + 1], "rwx") == 0)
             {
-                uint8_t rx = vm.memory[pc + 1] >> 4;
-                uint8_t shift_right = vm.memory[pc + 3] & 0x1F;
-                int32_t signed_val = vm.registers[rx];
-                int32_t temp_rx = vm.registers[rx];
-                signed_val >>= shift_right;
-
-                fprintf(output, "0x%04X->SAR_R%d>>=%d=0x%08X>>%d=0x%08X\n",
-                        pc, (int)rx, (int)shift_right, temp_rx, (int)shift_right, signed_val);
-
-                rx = rx * 4;
-                // sar dword ptr [rdi + rx], shift_right (4 bytes)
-                vm.executable_code[index++] = 0xC1;
-                vm.executable_code[index++] = 0x7F;
-                vm.executable_code[index++] = rx;
-                vm.executable_code[index++] = shift_right;
-                // inc dword ptr [rsi + 120] (4 bytes)
-                vm.executable_code[index++] = 0xFF;
-                vm.executable_code[index++] = 0x46;
-                vm.executable_code[index++] = 0x78;
-
-                break;
+                write_xor_execute = false;
             }
-
-            default:
+            else
             {
-                pc = 256;
                 break;
             }
-            }
+            arg += 2;
         }
-
-        uint8_t *jit_addr = vm.executable_code + (pc * 4);
-        JitFunc func = (JitFunc)jit_addr;
-        uintptr_t result = func(&vm.registers[0], &vm.instruction_counts[0], &vm.memory[0], &vm.save_bool);
-
-        if (result >= vm.code_base && result < vm.code_base + SIZE_CODE)
+        else if (strcmp(argv[arg], "--code-cache") == 0)
         {
-            pc = (result - vm.code_base) / 4;
-            pc--;
+            cache_dir = argv[arg + 1];
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--stats") == 0)
+        {
+            stats_path = argv[arg + 1];
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--perf") == 0)
+        {
+            perf_path = argv[arg + 1];
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--batch") == 0)
+        {
+            batch_path = argv[arg + 1];
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--jobs") == 0)
+        {
+            jobs = atoi(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--decode-trace") == 0 && arg + 2 < argc)
+        {
+            return pqp_decode_trace(argv[arg + 1], argv[arg + 2]) ? 0 : 1;
         }
         else
         {
-            pc = (uint32_t)result;
             break;
         }
     }
-
-    fprintf(output, "0x%04X->EXIT\n", (uint16_t)pc);
-    fprintf(output, "[");
-    for (int i = 0; i < 15; i++)
+    int positional = batch_path ? 0 : image_path ? 1 : 2;
+    if (arg + positional > argc || (positional > 0 && strncmp(argv[arg], "--", 2) == 0) || jobs == 0 ||
+        memory_bits < MIN_MEMORY_BITS || memory_bits > MAX_MEMORY_BITS)
     {
-        fprintf(output, "%02X:%u,", i, vm.instruction_counts[i]);
+        fprintf(stderr, "usage: %s [--mem-bits %d-%d] [--trace off|text|binary] [--counters profile|off] [--code-pages wx|rwx] [--code-cache dir] [--stats file] [--perf file] input output\n"
+                        "       %s [options] [--jobs N] --batch manifest\n"
+                        "       %s [--mem-bits %d-%d] --make-image image input\n"
+                        "       %s --decode-trace trace output\n",
+                argv[0], MIN_MEMORY_BITS, MAX_MEMORY_BITS, argv[0], argv[0], MIN_MEMORY_BITS, MAX_MEMORY_BITS, argv[0]);
+        return 1;
     }
-    fprintf(output, "0F:%u]\n", vm.instruction_counts[15]);
-    fprintf(output, "[");
-    for (size_t i = 0; i < REGISTERS_NUM - 1; ++i)
+
+    Run_options options = {{memory_bits, trace_mode, count_instructions, write_xor_execute, cache_dir, perf_path != nullptr},
+                           stats_path, perf_path};
+
+    if (batch_path != nullptr)
     {
-        fprintf(output, "R%u=0x%08X,", (unsigned int)i, vm.registers[i]);
+        return run_batch(options, batch_path, jobs) ? 0 : 1;
     }
-    fprintf(output, "R15=0x%08X]", vm.registers[15]);
 
-    fclose(output);
+    Machine_x86 *vm = pqp_create(options.vm);
+    bool succeeded;
+
+    if (vm == nullptr)
+    {
+        fprintf(stderr, "cannot create VM\n");
+        return 1;
+    }
+    if (image_path != nullptr)
+    {
+        succeeded = pqp_load(vm, argv[arg]);
+        if (!succeeded)
+        {
+            fprintf(stderr, "cannot load %s\n", argv[arg]);
+        }
+        else
+        {
+            succeeded = pqp_write_image(vm, image_path);
+        }
+    }
+    else
+    {
+        succeeded = run_program(vm, options, argv[arg], argv[arg + 1]);
+    }
 
-    return 0;
-}
\ No newline at end of file
+    pqp_destroy(vm);
+    return succeeded ? 0 : 1;
+}